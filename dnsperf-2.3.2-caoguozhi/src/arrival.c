@@ -0,0 +1,228 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrival.h"
+#include "util.h"
+
+static const char* kind_names[] = { "constant", "poisson", "onoff", "mmpp" };
+
+/*
+ * Reads up to two numbers after the model name, as in "onoff:10:90".
+ */
+static int parse_args(const char* args, double* first, double* second)
+{
+    char* end;
+
+    if (*args == 0)
+        return 0;
+    if (*args++ != ':')
+        return -1;
+    *first = strtod(args, &end);
+    if (end == args || *first <= 0)
+        return -1;
+    if (*end == 0)
+        return 0;
+    if (*end++ != ':')
+        return -1;
+    args    = end;
+    *second = strtod(args, &end);
+    if (end == args || *end != 0 || *second <= 0)
+        return -1;
+    return 0;
+}
+
+int perf_arrival_parse(const char* spec, struct perf_arrival_model* model)
+{
+    double       first, second;
+    size_t       len;
+    unsigned int i;
+
+    memset(model, 0, sizeof(*model));
+    for (i = 0; i < sizeof(kind_names) / sizeof(kind_names[0]); i++) {
+        len = strlen(kind_names[i]);
+        if (strncmp(spec, kind_names[i], len) == 0 && (spec[len] == 0 || spec[len] == ':'))
+            break;
+    }
+    if (i == sizeof(kind_names) / sizeof(kind_names[0])) {
+        errno = EINVAL;
+        return -1;
+    }
+    model->kind = i;
+
+    switch (model->kind) {
+    case perf_arrival_onoff:
+        first  = 10;
+        second = 90;
+        break;
+    case perf_arrival_mmpp:
+        first  = 4;
+        second = 100;
+        break;
+    default:
+        if (spec[len] != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+    if (parse_args(spec + len, &first, &second) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (model->kind == perf_arrival_onoff) {
+        model->on  = first * MILLION;
+        model->off = second * MILLION;
+    } else {
+        model->ratio = first;
+        model->dwell = second * MILLION;
+    }
+    return 0;
+}
+
+void perf_arrival_format(const struct perf_arrival_model* model, char* buf, size_t len)
+{
+    switch (model->kind) {
+    case perf_arrival_onoff:
+        snprintf(buf, len, "onoff, %g ms on, %g ms off", model->on / MILLION, model->off / MILLION);
+        break;
+    case perf_arrival_mmpp:
+        snprintf(buf, len, "mmpp, rates 1:%g, %g ms mean dwell", model->ratio, model->dwell / MILLION);
+        break;
+    default:
+        snprintf(buf, len, "%s", kind_names[model->kind]);
+        break;
+    }
+}
+
+/* xorshift64*, with a uniform double in (0, 1) from its top 53 bits */
+static double uniform(struct perf_arrival* a)
+{
+    a->rng ^= a->rng >> 12;
+    a->rng ^= a->rng << 25;
+    a->rng ^= a->rng >> 27;
+    return (((a->rng * 0x2545F4914F6CDD1DULL) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double exponential(struct perf_arrival* a, double mean)
+{
+    return -log(uniform(a)) * mean;
+}
+
+void perf_arrival_init(struct perf_arrival* a, const struct perf_arrival_model* model,
+    uint32_t rate, uint64_t seed)
+{
+    double low;
+
+    memset(a, 0, sizeof(*a));
+    a->model = *model;
+    a->rate  = rate;
+
+    /* splitmix64 of the seed, so that nearby seeds give unrelated streams */
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    a->rng = (seed ^ (seed >> 31)) | 1;
+
+    switch (model->kind) {
+    case perf_arrival_onoff:
+        /* The first burst starts with the run. */
+        a->t = -(double)BILLION * model->on / (model->on + model->off) / rate;
+        break;
+    case perf_arrival_mmpp:
+        /* Equal mean dwells: the mean rate is that of the two halfway. */
+        low          = 2.0 * rate / (1 + model->ratio);
+        a->rates[0]  = low / BILLION;
+        a->rates[1]  = low * model->ratio / BILLION;
+        a->state_end = exponential(a, model->dwell);
+        break;
+    default:
+        break;
+    }
+}
+
+static double draw(struct perf_arrival* a)
+{
+    double period, pos;
+
+    switch (a->model.kind) {
+    case perf_arrival_poisson:
+        a->t += exponential(a, (double)BILLION / a->rate);
+        break;
+    case perf_arrival_onoff:
+        period = a->model.on + a->model.off;
+        a->t += (double)BILLION * a->model.on / period / a->rate;
+        pos = fmod(a->t, period);
+        if (pos >= a->model.on)
+            a->t += period - pos;
+        break;
+    case perf_arrival_mmpp:
+        /* Memoryless: a gap that crosses a switch is drawn again there. */
+        for (;;) {
+            a->t += exponential(a, 1 / a->rates[a->state]);
+            if (a->t < a->state_end)
+                break;
+            a->t = a->state_end;
+            a->state ^= 1;
+            a->state_end += exponential(a, a->model.dwell);
+        }
+        break;
+    default:
+        break;
+    }
+    return a->t;
+}
+
+void perf_arrival_fill(struct perf_arrival* a, uint64_t n)
+{
+    uint64_t until = n + PERF_ARRIVAL_RING / 2;
+
+    for (; a->next < until; a->next++) {
+        if (a->model.kind == perf_arrival_constant)
+            a->times[a->next % PERF_ARRIVAL_RING] = (MILLION * a->next) / a->rate * 1000;
+        else
+            a->times[a->next % PERF_ARRIVAL_RING] = draw(a);
+    }
+}
+
+uint64_t perf_arrival_count(struct perf_arrival* a, uint64_t n, uint64_t end, bool* estimated)
+{
+    uint64_t us, total, i, t = 0;
+
+    *estimated = false;
+    if (a->model.kind == perf_arrival_constant) {
+        /* Arrival i is due at floor(MILLION * i / rate) us. */
+        us    = (end + 999) / 1000;
+        total = us / MILLION * a->rate + (us % MILLION * a->rate + MILLION - 1) / MILLION;
+        return total > n ? total - n : 0;
+    }
+
+    for (i = n; i < n + PERF_ARRIVAL_RING / 2; i++) {
+        t = perf_arrival_at(a, i);
+        if (t >= end)
+            return i - n;
+    }
+    *estimated = true;
+    return i - n + (uint64_t)((double)(end - t) * a->rate / BILLION);
+}
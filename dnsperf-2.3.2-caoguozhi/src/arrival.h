@@ -0,0 +1,100 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PERF_ARRIVAL_H
+#define PERF_ARRIVAL_H 1
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Arrival processes for -Q.  Each thread draws its own schedule, the
+ * time into the run at which each of its queries is due:
+ *
+ *   constant            every 1/rate seconds
+ *   poisson             exponential gaps of mean 1/rate
+ *   onoff[:on[:off]]    on ms of evenly paced bursts, then off ms of
+ *                       silence (default 10:90)
+ *   mmpp[:ratio[:ms]]   Poisson arrivals, switching between a low and a
+ *                       ratio times higher rate after exponential
+ *                       dwells of mean ms in either (default 4:100)
+ *
+ * All keep the mean rate.  The schedule is drawn ahead in blocks into a
+ * ring of PERF_ARRIVAL_RING entries, so reading it is an array lookup;
+ * perf_arrival_at() may be asked for any arrival from half a ring below
+ * the highest one it was asked for onwards.
+ */
+enum perf_arrival_kind {
+    perf_arrival_constant,
+    perf_arrival_poisson,
+    perf_arrival_onoff,
+    perf_arrival_mmpp
+};
+
+struct perf_arrival_model {
+    enum perf_arrival_kind kind;
+    double                 on, off; /* onoff, in ns */
+    double                 ratio; /* mmpp */
+    double                 dwell; /* mmpp, in ns */
+};
+
+#define PERF_ARRIVAL_RING 8192
+
+struct perf_arrival {
+    struct perf_arrival_model model;
+    uint32_t                  rate;
+    uint64_t                  rng;
+    double                    t; /* of the last arrival drawn, ns */
+    double                    rates[2]; /* mmpp, per ns */
+    int                       state;
+    double                    state_end;
+    uint64_t                  next; /* the next arrival to draw */
+    uint64_t                  times[PERF_ARRIVAL_RING];
+};
+
+int perf_arrival_parse(const char* spec, struct perf_arrival_model* model);
+
+void perf_arrival_format(const struct perf_arrival_model* model, char* buf, size_t len);
+
+void perf_arrival_init(struct perf_arrival* a, const struct perf_arrival_model* model,
+    uint32_t rate, uint64_t seed);
+
+void perf_arrival_fill(struct perf_arrival* a, uint64_t n);
+
+/*
+ * The number of arrivals from n on that are due before end, in ns into
+ * the run.  Exact for the constant model; the others are walked for at
+ * most half a ring, and past that the rest is estimated from the mean
+ * rate and *estimated is set.
+ */
+uint64_t perf_arrival_count(struct perf_arrival* a, uint64_t n, uint64_t end, bool* estimated);
+
+/*
+ * Nanoseconds into the run at which arrival n (from 0) is due.
+ */
+static inline uint64_t
+perf_arrival_at(struct perf_arrival* a, uint64_t n)
+{
+    if (n >= a->next)
+        perf_arrival_fill(a, n);
+    return a->times[n % PERF_ARRIVAL_RING];
+}
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <isc/result.h>
+#include <isc/types.h>
+
+#include "capture.h"
+#include "log.h"
+#include "os.h"
+#include "util.h"
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER 32
+#define CAPTURE_BLOCK_HEADER 24
+#define CAPTURE_POLL_USEC 10000
+/* send time, latency, rcode, qtype, socket, size */
+#define CAPTURE_MAX_RECORD (10 + 10 + 2 + 3 + 5 + 3)
+
+struct perf_capture {
+    FILE*                    fp;
+    const char*              path;
+    pthread_t                writer;
+    bool                     stopping;
+    bool                     failed;
+    unsigned int             nproducers;
+    struct perf_capture_buf* producers;
+    unsigned char*           out;
+    uint64_t                 written;
+};
+
+static unsigned char*
+put_le(unsigned char* p, uint64_t v, unsigned int bytes)
+{
+    while (bytes-- > 0) {
+        *p++ = v & 0xff;
+        v >>= 8;
+    }
+    return p;
+}
+
+static unsigned char*
+put_varint(unsigned char* p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static void
+write_out(struct perf_capture* cap, const unsigned char* buf, size_t len)
+{
+    if (cap->failed)
+        return;
+    if (fwrite(buf, 1, len, cap->fp) != len) {
+        perf_log_warning("capture to %s failed: %s", cap->path, strerror(errno));
+        cap->failed = true;
+    }
+}
+
+static void
+write_chunk(struct perf_capture* cap, unsigned int producer, const struct perf_capture_chunk* chunk)
+{
+    const struct perf_capture_rec* rec;
+    unsigned char *                p, *start;
+    uint64_t                       prev;
+    int64_t                        delta;
+    unsigned int                   i;
+
+    if (chunk->n == 0)
+        return;
+    start = cap->out + CAPTURE_BLOCK_HEADER;
+    p     = start;
+    prev  = chunk->recs[0].sent;
+    for (i = 0; i < chunk->n; i++) {
+        rec   = &chunk->recs[i];
+        delta = (int64_t)(rec->sent - prev);
+        prev  = rec->sent;
+        p     = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        p     = put_varint(p, rec->latency);
+        p     = put_varint(p, rec->rcode);
+        p     = put_varint(p, rec->qtype);
+        p     = put_varint(p, rec->socket);
+        p     = put_varint(p, rec->size);
+    }
+    put_le(put_le(put_le(put_le(put_le(cap->out, p - start, 4), chunk->n, 4), producer, 4), 0, 4),
+        chunk->recs[0].sent, 8);
+    write_out(cap, cap->out, p - cap->out);
+    if (!cap->failed)
+        cap->written += chunk->n;
+}
+
+/*
+ * Write the chunks the producers have handed over and give them back.
+ */
+static void
+drain(struct perf_capture* cap)
+{
+    struct perf_capture_buf*   buf;
+    struct perf_capture_chunk* chunk;
+    unsigned int               i;
+    uint32_t                   head;
+
+    for (i = 0; i < cap->nproducers; i++) {
+        buf  = &cap->producers[i];
+        head = __atomic_load_n(&buf->full_head, __ATOMIC_ACQUIRE);
+        while (buf->full_tail != head) {
+            chunk = buf->full[buf->full_tail % PERF_CAPTURE_RING];
+            write_chunk(cap, i, chunk);
+            chunk->n = 0;
+            buf->empty[buf->empty_head % PERF_CAPTURE_RING] = chunk;
+            __atomic_store_n(&buf->empty_head, buf->empty_head + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&buf->full_tail, buf->full_tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void*
+do_write(void* arg)
+{
+    struct perf_capture* cap = arg;
+
+    while (!__atomic_load_n(&cap->stopping, __ATOMIC_ACQUIRE)) {
+        drain(cap);
+        usleep(CAPTURE_POLL_USEC);
+    }
+    drain(cap);
+    return NULL;
+}
+
+struct perf_capture* perf_capture_open(const char* path, unsigned int nproducers, uint64_t now)
+{
+    struct perf_capture* cap;
+    unsigned char        header[CAPTURE_HEADER], *p;
+
+    cap = calloc(1, sizeof(*cap));
+    if (cap == NULL)
+        perf_log_fatal("out of memory");
+    cap->path       = path;
+    cap->nproducers = nproducers;
+    cap->producers  = calloc(nproducers, sizeof(*cap->producers));
+    cap->out        = malloc(CAPTURE_BLOCK_HEADER + PERF_CAPTURE_CHUNK * CAPTURE_MAX_RECORD);
+    if (cap->producers == NULL || cap->out == NULL)
+        perf_log_fatal("out of memory");
+    if ((cap->fp = fopen(path, "wb")) == NULL)
+        perf_log_fatal("unable to open capture file %s: %s", path, strerror(errno));
+    setvbuf(cap->fp, NULL, _IOFBF, 1 << 20);
+
+    p = header;
+    memcpy(p, "DPERFCAP", 8);
+    p = put_le(p + 8, CAPTURE_VERSION, 2);
+    p = put_le(p, CAPTURE_HEADER, 2);
+    p = put_le(p, 0, 4);
+    p = put_le(p, now, 8);
+    p = put_le(p, perf_os_clock_towall(now), 8);
+    write_out(cap, header, sizeof(header));
+
+    THREAD(&cap->writer, do_write, cap);
+    return cap;
+}
+
+struct perf_capture_buf* perf_capture_producer(struct perf_capture* cap, unsigned int producer)
+{
+    return &cap->producers[producer];
+}
+
+void perf_capture_flush(struct perf_capture_buf* buf)
+{
+    uint32_t tail;
+
+    if (buf->cur != NULL && buf->cur->n > 0) {
+        /* nchunks never exceeds the ring, so this cannot overflow it */
+        buf->full[buf->full_head % PERF_CAPTURE_RING] = buf->cur;
+        __atomic_store_n(&buf->full_head, buf->full_head + 1, __ATOMIC_RELEASE);
+        buf->cur = NULL;
+    }
+    if (buf->cur != NULL)
+        return;
+
+    tail = buf->empty_tail;
+    if (tail != __atomic_load_n(&buf->empty_head, __ATOMIC_ACQUIRE)) {
+        buf->cur = buf->empty[tail % PERF_CAPTURE_RING];
+        __atomic_store_n(&buf->empty_tail, tail + 1, __ATOMIC_RELEASE);
+    } else if (buf->nchunks < PERF_CAPTURE_RING) {
+        buf->cur = calloc(1, sizeof(*buf->cur));
+        if (buf->cur != NULL)
+            buf->nchunks++;
+    }
+}
+
+uint64_t perf_capture_close(struct perf_capture* cap, uint64_t* dropped)
+{
+    struct perf_capture_buf* buf;
+    unsigned int             i;
+    uint64_t                 written;
+
+    __atomic_store_n(&cap->stopping, true, __ATOMIC_RELEASE);
+    JOIN(cap->writer, NULL);
+
+    *dropped = 0;
+    for (i = 0; i < cap->nproducers; i++) {
+        buf = &cap->producers[i];
+        if (buf->cur != NULL)
+            write_chunk(cap, i, buf->cur);
+        free(buf->cur);
+        while (buf->empty_tail != buf->empty_head)
+            free(buf->empty[buf->empty_tail++ % PERF_CAPTURE_RING]);
+        *dropped += buf->dropped;
+    }
+    if (fclose(cap->fp) != 0 && !cap->failed)
+        perf_log_warning("capture to %s failed: %s", cap->path, strerror(errno));
+
+    written = cap->written;
+    free(cap->out);
+    free(cap->producers);
+    free(cap);
+    return written;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PERF_CAPTURE_H
+#define PERF_CAPTURE_H 1
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Streaming capture of every response, written during the run by a
+ * background thread.  Each producer (a receiving thread) fills chunks of
+ * fixed-size records and hands full ones to the writer through a
+ * single-producer/single-consumer ring; the writer encodes them and
+ * hands the chunks back through another.  A producer never waits: when
+ * the writer falls PERF_CAPTURE_RING chunks behind, records are dropped
+ * and counted.
+ *
+ * The file starts with a 32 byte header, all integers little endian:
+ *
+ *	"DPERFCAP", u16 version (1), u16 header length, u32 reserved,
+ *	u64 clock at open (ns), u64 wall clock at open (ns since the epoch)
+ *
+ * followed by blocks, one per chunk:
+ *
+ *	u32 payload length, u32 records, u32 producer, u32 reserved,
+ *	u64 send time of the first record (ns, same clock as the header)
+ *
+ * whose payload holds per record: the zigzag varint difference of its
+ * send time from the previous record's, then varints of the latency
+ * (ns), the rcode, the qtype, the socket and the response size.
+ */
+
+#define PERF_CAPTURE_CHUNK 4096
+#define PERF_CAPTURE_RING 64
+
+struct perf_capture_rec {
+    uint64_t sent;
+    uint64_t latency;
+    uint32_t socket;
+    uint16_t qtype;
+    uint16_t size;
+    uint8_t  rcode;
+};
+
+struct perf_capture_chunk {
+    unsigned int            n;
+    struct perf_capture_rec recs[PERF_CAPTURE_CHUNK];
+};
+
+struct perf_capture_buf {
+    struct perf_capture_chunk* cur;
+    unsigned int               nchunks;
+    uint64_t                   dropped;
+
+    /* producer -> writer */
+    struct perf_capture_chunk* full[PERF_CAPTURE_RING];
+    uint32_t                   full_head, full_tail;
+    /* writer -> producer */
+    struct perf_capture_chunk* empty[PERF_CAPTURE_RING];
+    uint32_t                   empty_head, empty_tail;
+};
+
+struct perf_capture;
+
+struct perf_capture* perf_capture_open(const char* path, unsigned int nproducers, uint64_t now);
+
+struct perf_capture_buf* perf_capture_producer(struct perf_capture* cap, unsigned int producer);
+
+/*
+ * Hand the producer's current chunk to the writer and take an empty
+ * one.  Only the producer's thread may call it.
+ */
+void perf_capture_flush(struct perf_capture_buf* buf);
+
+/*
+ * Stop the writer once the producers are done, write what is left and
+ * close the file.  Returns the number of records written and sets
+ * *dropped to those lost.
+ */
+uint64_t perf_capture_close(struct perf_capture* cap, uint64_t* dropped);
+
+static inline void
+perf_capture_add(struct perf_capture_buf* buf, const struct perf_capture_rec* rec)
+{
+    if (buf->cur == NULL || buf->cur->n == PERF_CAPTURE_CHUNK) {
+        perf_capture_flush(buf);
+        if (buf->cur == NULL) {
+            buf->dropped++;
+            return;
+        }
+    }
+    buf->cur->recs[buf->cur->n++] = *rec;
+}
+
+#endif
@@ -1045,3 +1045,20 @@ perf_dns_buildrequest(perf_dnsctx_t* ctx, const isc_textregion_t* record,
 
     return (ISC_R_SUCCESS);
 }
+
+/*
+ * The type of the question of a request built by perf_dns_buildrequest(),
+ * read back from the wire: the name is uncompressed and follows the
+ * header.  Returns 0 if the message is too short.
+ */
+uint16_t
+perf_dns_qtype(const unsigned char* msg, unsigned int len)
+{
+    unsigned int off = 12;
+
+    while (off < len && msg[off] != 0)
+        off += msg[off] + 1;
+    if (off + 3 > len)
+        return 0;
+    return (msg[off + 1] << 8) | msg[off + 2];
+}
@@ -53,4 +53,7 @@ perf_dns_buildrequest(perf_dnsctx_t* ctx, const isc_textregion_t* record,
     perf_dnstsigkey_t*    tsigkey,
     perf_dnsednsoption_t* edns_option, isc_buffer_t* msg);
 
+uint16_t
+perf_dns_qtype(const unsigned char* msg, unsigned int len);
+
 #endif
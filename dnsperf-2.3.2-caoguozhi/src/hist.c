@@ -0,0 +1,116 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+int perf_hist_init(struct perf_hist* h, unsigned int digits)
+{
+    uint64_t range;
+
+    memset(h, 0, sizeof(*h));
+    if (digits < 1 || digits > PERF_HIST_MAX_DIGITS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Bucket width is at most 2^-(bits - 1) of the value. */
+    h->digits = digits;
+    for (range = 1; digits > 0; digits--)
+        range *= 10;
+    for (h->bits = 1; (1ULL << (h->bits - 1)) < range; h->bits++)
+        ;
+    h->nbuckets = (1U << h->bits) + (PERF_HIST_RANGE_BITS - h->bits) * (1U << (h->bits - 1));
+    h->counts   = calloc(h->nbuckets, sizeof(*h->counts));
+    if (h->counts == NULL)
+        return -1;
+    return 0;
+}
+
+void perf_hist_destroy(struct perf_hist* h)
+{
+    free(h->counts);
+    h->counts = NULL;
+}
+
+void perf_hist_reset(struct perf_hist* h)
+{
+    memset(h->counts, 0, h->nbuckets * sizeof(*h->counts));
+    h->count = h->sum = h->min = h->max = 0;
+}
+
+void perf_hist_merge(struct perf_hist* dst, const struct perf_hist* src)
+{
+    unsigned int i;
+
+    if (src->count == 0)
+        return;
+    for (i = 0; i < dst->nbuckets; i++)
+        dst->counts[i] += src->counts[i];
+    if (src->min < dst->min || dst->count == 0)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->sum += src->sum;
+    dst->count += src->count;
+}
+
+/*
+ * The middle of a bucket, the value the bucket stands for.
+ */
+static uint64_t
+bucket_value(const struct perf_hist* h, unsigned int index)
+{
+    unsigned int half = 1U << (h->bits - 1), shift;
+    uint64_t     low;
+
+    if (index < (1U << h->bits))
+        return index;
+    shift = (index - (1U << h->bits)) / half + 1;
+    low   = (uint64_t)((index - (1U << h->bits)) % half + half) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+uint64_t perf_hist_percentile(const struct perf_hist* h, double pct)
+{
+    uint64_t     want, seen, value;
+    unsigned int i;
+
+    if (h->count == 0)
+        return 0;
+    if (pct >= 100.0)
+        return h->max;
+    want = (uint64_t)(pct / 100.0 * h->count);
+    if (want >= h->count)
+        want = h->count - 1;
+    for (seen = 0, i = 0; i < h->nbuckets; i++) {
+        seen += h->counts[i];
+        if (seen > want)
+            break;
+    }
+    value = bucket_value(h, i);
+    if (value < h->min)
+        value = h->min;
+    if (value > h->max)
+        value = h->max;
+    return value;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PERF_HIST_H
+#define PERF_HIST_H 1
+
+#include <inttypes.h>
+
+/*
+ * A log-linear latency histogram in the manner of HdrHistogram: values
+ * below 2^bits are counted exactly, each power of two above that is
+ * split into 2^(bits - 1) equal buckets.  Every value then lands in a
+ * bucket no wider than 10^-digits of it, recording is O(1) and two
+ * histograms of the same precision merge bucket by bucket.  Values of
+ * 2^PERF_HIST_RANGE_BITS (about 4.9 hours in ns) and more share the
+ * last bucket.
+ */
+struct perf_hist {
+    unsigned int digits;
+    unsigned int bits;
+    unsigned int nbuckets;
+    uint64_t     count;
+    uint64_t     sum;
+    uint64_t     min, max;
+    uint64_t*    counts;
+};
+
+#define PERF_HIST_MAX_DIGITS 4
+#define PERF_HIST_RANGE_BITS 44
+
+int perf_hist_init(struct perf_hist* h, unsigned int digits);
+
+void perf_hist_destroy(struct perf_hist* h);
+
+void perf_hist_reset(struct perf_hist* h);
+
+void perf_hist_merge(struct perf_hist* dst, const struct perf_hist* src);
+
+/*
+ * The value below which pct percent of the recorded values fall, to the
+ * precision of the histogram, or 0 if it is empty.
+ */
+uint64_t perf_hist_percentile(const struct perf_hist* h, double pct);
+
+static inline unsigned int
+perf_hist_index(const struct perf_hist* h, uint64_t value)
+{
+    unsigned int shift;
+
+    if (value < (1ULL << h->bits))
+        return value;
+    if (value >> PERF_HIST_RANGE_BITS)
+        return h->nbuckets - 1;
+    shift = 63 - __builtin_clzll(value) - h->bits + 1;
+    return (1U << h->bits) + ((shift - 1) << (h->bits - 1)) + (value >> shift) - (1U << (h->bits - 1));
+}
+
+static inline void
+perf_hist_record(struct perf_hist* h, uint64_t value)
+{
+    h->counts[perf_hist_index(h, value)]++;
+    if (value < h->min || h->count == 0)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->sum += value;
+    h->count++;
+}
+
+#endif
@@ -17,6 +17,10 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -34,17 +38,83 @@
 #include <bind9/getaddresses.h>
 
 #include <arpa/inet.h>
+#include <netinet/udp.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef XDP_USE_NEED_WAKEUP
+#define HAVE_AF_XDP 1
+#endif
+#endif
+#endif
 
 #include "log.h"
 #include "net.h"
 #include "opt.h"
 #include "os.h"
 
+#ifdef UDP_SEGMENT
+/*
+ * Limits of one UDP GSO send: the kernel takes at most 64 segments, and
+ * the whole buffer has to fit in one IP datagram.
+ */
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#endif
+
+#ifdef UDP_GRO
+/*
+ * UDP GRO: the kernel may hand over up to 64 same-sized responses of a
+ * flow as one buffer, so a socket with GRO reads into its own large
+ * buffers and deals the segments out one response at a time.  Segments
+ * not yet dealt out stay pending for the next read.  The buffers are
+ * only allocated by the first read, so sockets that never receive on a
+ * thread cost nothing.
+ */
+#define GRO_BUFS 4
+#define GRO_BUFSIZE 65535
+
+struct perf_net_gro {
+    unsigned char* bufs;
+    size_t         len[GRO_BUFS];
+    size_t         seg[GRO_BUFS];
+    uint64_t       rx_time[GRO_BUFS];
+    unsigned int   nmsgs, cur;
+    size_t         off;
+};
+
+static int gro_recv(struct perf_net_socket* sock, struct perf_net_packet* pkts, unsigned int npkts, int flags);
+#endif
+
 #define TCP_RECV_BUF_SIZE (16 * 1024)
 #define TCP_SEND_BUF_SIZE (4 * 1024)
 
 static SSL_CTX* ssl_ctx = 0;
 
+#ifdef HAVE_IO_URING
+static int uring_send(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts);
+#endif
+#ifdef HAVE_AF_XDP
+static int xdp_send(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts);
+#endif
+
 int perf_net_parsefamily(const char* family)
 {
     if (family == NULL || strcmp(family, "any") == 0)
@@ -111,12 +181,146 @@ void perf_net_parselocal(int family, const char* name, unsigned int port,
     }
 }
 
-struct perf_net_socket perf_net_opensocket(enum perf_net_mode mode, const isc_sockaddr_t* server, const isc_sockaddr_t* local,
-    unsigned int offset, int bufsize)
+/*
+ * Add the host addresses of a CIDR block to addrs.  Blocks wider than
+ * /31 leave out their first and last address.
+ */
+static void parsecidr(const char* spec, unsigned int port, isc_sockaddr_t* addrs, unsigned int* naddrs)
+{
+    char            name[INET6_ADDRSTRLEN];
+    const char*     slash = strchr(spec, '/');
+    struct in_addr  in4a;
+    struct in6_addr in6a;
+    unsigned int    prefix, bits, i;
+    uint32_t        base, count;
+    char*           end;
+
+    prefix = strtoul(slash + 1, &end, 10);
+    if ((size_t)(slash - spec) >= sizeof(name) || end == slash + 1 || *end != 0)
+        perf_log_fatal("invalid local address %s", spec);
+    memcpy(name, spec, slash - spec);
+    name[slash - spec] = 0;
+
+    if (inet_pton(AF_INET, name, &in4a) == 1) {
+        bits = 32;
+    } else if (inet_pton(AF_INET6, name, &in6a) == 1) {
+        bits = 128;
+        memcpy(&base, &in6a.s6_addr[12], 4);
+        in4a.s_addr = base;
+    } else {
+        perf_log_fatal("invalid local address %s", spec);
+    }
+    if (prefix > bits || bits - prefix > 16)
+        perf_log_fatal("invalid local address range %s: at most %u addresses", spec, PERF_NET_MAX_LOCAL_ADDRS);
+
+    count = 1U << (bits - prefix);
+    base  = ntohl(in4a.s_addr) & ~(count - 1);
+    if (count > 2) {
+        base++;
+        count -= 2;
+    }
+    if (*naddrs + count > PERF_NET_MAX_LOCAL_ADDRS)
+        perf_log_fatal("too many local addresses, at most %u", PERF_NET_MAX_LOCAL_ADDRS);
+    for (i = 0; i < count; i++) {
+        in4a.s_addr = htonl(base + i);
+        if (bits == 32) {
+            isc_sockaddr_fromin(&addrs[(*naddrs)++], &in4a, port);
+        } else {
+            memcpy(&in6a.s6_addr[12], &in4a.s_addr, 4);
+            isc_sockaddr_fromin6(&addrs[(*naddrs)++], &in6a, port);
+        }
+    }
+}
+
+unsigned int perf_net_parselocals(int family, const char* spec, unsigned int port,
+    isc_sockaddr_t** addrsp)
+{
+    isc_sockaddr_t* addrs;
+    unsigned int    naddrs = 0;
+    char*           copy;
+    char*           item;
+    char*           next;
+
+    addrs = calloc(PERF_NET_MAX_LOCAL_ADDRS, sizeof(*addrs));
+    if (!addrs)
+        perf_log_fatal("out of memory");
+
+    if (spec == NULL || strpbrk(spec, ",/") == NULL) {
+        perf_net_parselocal(family, spec, port, &addrs[naddrs++]);
+    } else {
+        if (!(copy = strdup(spec)))
+            perf_log_fatal("out of memory");
+        for (item = copy; item != NULL; item = next) {
+            if ((next = strchr(item, ',')) != NULL)
+                *next++ = 0;
+            if (strchr(item, '/'))
+                parsecidr(item, port, addrs, &naddrs);
+            else if (naddrs == PERF_NET_MAX_LOCAL_ADDRS)
+                perf_log_fatal("too many local addresses, at most %u", PERF_NET_MAX_LOCAL_ADDRS);
+            else
+                perf_net_parselocal(family, item, port, &addrs[naddrs++]);
+        }
+        free(copy);
+    }
+
+    *addrsp = realloc(addrs, naddrs * sizeof(*addrs));
+    if (!*addrsp)
+        perf_log_fatal("out of memory");
+    return naddrs;
+}
+
+#if defined(__linux__) && defined(IP_BIND_ADDRESS_NO_PORT)
+#ifndef IP_LOCAL_PORT_RANGE
+#define IP_LOCAL_PORT_RANGE 51
+#endif
+
+/*
+ * Leave the choice of source port to connect(), from first to last.
+ * With IP_BIND_ADDRESS_NO_PORT bind() reserves no port, so connect()
+ * only needs the 4-tuple to be unique and skips ports still in
+ * TIME_WAIT from an earlier run.  The kernel only narrows its ephemeral
+ * range (ip_local_port_range) with IP_LOCAL_PORT_RANGE, so ranges
+ * outside of it are left to the caller.
+ */
+static int portrange(int fd, unsigned int first, unsigned int last)
+{
+    static unsigned int lo, hi;
+    int                 on    = 1;
+    uint32_t            range = last << 16 | first;
+    FILE*               f;
+
+    if (lo == 0 && (f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r")) != NULL) {
+        if (fscanf(f, "%u %u", &lo, &hi) != 2)
+            lo = hi = 0;
+        fclose(f);
+    }
+    if (first < lo || last > hi) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)) < 0)
+        return -1;
+    return setsockopt(fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range, sizeof(range));
+}
+#else
+static int portrange(int fd, unsigned int first, unsigned int last)
+{
+    errno = ENOPROTOOPT;
+    return -1;
+}
+#endif
+
+/*
+ * Open a socket bound to local.  Stream sockets given a port range
+ * [first, last] pick their port from it when connecting, or bind to
+ * local's port with SO_REUSEADDR when the kernel cannot do that.
+ * With freebind the address need not be configured on the host.
+ */
+static struct perf_net_socket opensocket(enum perf_net_mode mode, const isc_sockaddr_t* server, const isc_sockaddr_t* local,
+    unsigned int first, unsigned int last, int bufsize, bool freebind)
 {
     int                    family;
     isc_sockaddr_t         tmp;
-    int                    port;
     int                    ret;
     int                    flags;
     struct perf_net_socket sock = {.mode = mode, .is_ready = 1 };
@@ -174,17 +378,29 @@ struct perf_net_socket perf_net_opensocket(enum perf_net_mode mode, const isc_so
     }
 #endif
 
-    tmp  = *local;
-    port = isc_sockaddr_getport(&tmp);
-    if (port != 0 && offset != 0) {
-        port += offset;
-        if (port >= 0xFFFF)
-            perf_log_fatal("port %d out of range", port);
-        isc_sockaddr_setport(&tmp, port);
+#ifdef IP_FREEBIND
+    if (freebind) {
+        int on = 1;
+
+        if (setsockopt(sock.fd, IPPROTO_IP, IP_FREEBIND, &on, sizeof(on)) == -1)
+            perf_log_warning("setsockopt(IP_FREEBIND) failed");
+    }
+#endif
+
+    tmp = *local;
+    if (mode != sock_udp && last != 0) {
+        if (first < last && portrange(sock.fd, first, last) == 0) {
+            isc_sockaddr_setport(&tmp, 0);
+        } else {
+            int on = 1;
+
+            if (setsockopt(sock.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+                perf_log_warning("setsockopt(SO_REUSEADDR) failed");
+        }
     }
 
     if (bind(sock.fd, &tmp.type.sa, tmp.length) == -1)
-        perf_log_fatal("bind: %s", strerror(errno));
+        perf_log_fatal("bind to port %u: %s", isc_sockaddr_getport(&tmp), strerror(errno));
 
     if (bufsize > 0) {
         bufsize *= 1024;
@@ -211,6 +427,13 @@ struct perf_net_socket perf_net_opensocket(enum perf_net_mode mode, const isc_so
         if (connect(sock.fd, &server->type.sa, server->length)) {
             if (errno == EINPROGRESS) {
                 sock.is_ready = 0;
+            } else if (errno == EADDRNOTAVAIL && isc_sockaddr_getport(&tmp) == 0) {
+                /* The kernel's search may miss the last free ports of a
+                 * range; bind this one to its own port instead. */
+                if (sock.ssl)
+                    SSL_free(sock.ssl);
+                close(sock.fd);
+                return opensocket(mode, server, local, isc_sockaddr_getport(local), isc_sockaddr_getport(local), bufsize, freebind);
             } else {
                 perf_log_fatal("connect() failed: %s", strerror(errno));
             }
@@ -227,8 +450,46 @@ struct perf_net_socket perf_net_opensocket(enum perf_net_mode mode, const isc_so
     return sock;
 }
 
+struct perf_net_socket perf_net_opensocket(enum perf_net_mode mode, const isc_sockaddr_t* server, const isc_sockaddr_t* local,
+    unsigned int offset, int bufsize)
+{
+    isc_sockaddr_t tmp;
+    int            port;
+
+    tmp  = *local;
+    port = isc_sockaddr_getport(&tmp);
+    if (port != 0 && offset != 0) {
+        port += offset;
+        if (port >= 0xFFFF)
+            perf_log_fatal("port %d out of range", port);
+        isc_sockaddr_setport(&tmp, port);
+    }
+    return opensocket(mode, server, &tmp, 0, 0, bufsize, false);
+}
+
+struct perf_net_socket perf_net_opensocket_range(enum perf_net_mode mode, const isc_sockaddr_t* server,
+    const isc_sockaddr_t* local, unsigned int port, unsigned int first, unsigned int last, int bufsize,
+    bool freebind)
+{
+    isc_sockaddr_t tmp;
+
+    tmp = *local;
+    isc_sockaddr_setport(&tmp, port);
+    return opensocket(mode, server, &tmp, first, last, bufsize, freebind);
+}
+
 ssize_t perf_net_recv(struct perf_net_socket* sock, void* buf, size_t len, int flags)
 {
+#ifdef UDP_GRO
+    if (sock->gro) {
+        struct perf_net_packet pkt = { .buf = buf, .len = len };
+
+        if (gro_recv(sock, &pkt, 1, flags) < 0)
+            return -1;
+        return pkt.len;
+    }
+#endif
+
     switch (sock->mode) {
     case sock_tls: {
         ssize_t  n;
@@ -337,6 +598,241 @@ ssize_t perf_net_recv(struct perf_net_socket* sock, void* buf, size_t len, int f
     return recv(sock->fd, buf, len, flags);
 }
 
+/*
+ * Extract the kernel receive timestamp, wall-clock nanoseconds, from a
+ * message's control data.
+ */
+static uint64_t rx_timestamp(struct msghdr* msg)
+{
+    struct cmsghdr* cmsg;
+    struct timespec ts;
+    struct timeval  tv;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+#ifdef SCM_TIMESTAMPNS
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+#endif
+        if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+            return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Kernel stamps are wall-clock; carry them over to perf_os_clock as an
+ * age relative to a pair of readings taken now.
+ */
+static void rx_clock_pair(uint64_t* now, uint64_t* wall)
+{
+    struct timespec ts;
+
+    *now = perf_os_clock_now();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *wall = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef UDP_GRO
+int perf_net_gro(struct perf_net_socket* sock)
+{
+    int on = 1;
+
+    if (sock->mode != sock_udp || sock->uring) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    sock->gro = calloc(1, sizeof(*sock->gro));
+    if (sock->gro == NULL)
+        return -1;
+    if (setsockopt(sock->fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        free(sock->gro);
+        sock->gro = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the next set of (possibly coalesced) datagrams. */
+static int gro_fill(struct perf_net_socket* sock, int flags)
+{
+    struct perf_net_gro* gro = sock->gro;
+    struct mmsghdr       msgs[GRO_BUFS];
+    struct iovec         iovs[GRO_BUFS];
+    struct cmsghdr*      cmsg;
+    uint64_t             now, wall, stamp;
+    unsigned int         i;
+    int                  n, seg;
+    union {
+        char           buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } ctls[GRO_BUFS];
+
+    if (gro->bufs == NULL && (gro->bufs = malloc(GRO_BUFS * GRO_BUFSIZE)) == NULL)
+        return -1;
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < GRO_BUFS; i++) {
+        iovs[i].iov_base                = gro->bufs + i * GRO_BUFSIZE;
+        iovs[i].iov_len                 = GRO_BUFSIZE;
+        msgs[i].msg_hdr.msg_iov        = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen     = 1;
+        msgs[i].msg_hdr.msg_control    = ctls[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctls[i].buf);
+    }
+    n = recvmmsg(sock->fd, msgs, GRO_BUFS, flags, NULL);
+    if (n < 0)
+        return -1;
+
+    now = wall = 0;
+    if (sock->timestamps)
+        rx_clock_pair(&now, &wall);
+    for (i = 0; i < (unsigned int)n; i++) {
+        gro->len[i] = msgs[i].msg_len;
+        gro->seg[i] = msgs[i].msg_len;
+        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+                if (seg > 0)
+                    gro->seg[i] = seg;
+            }
+        }
+        /* Every segment of a coalesced read shares its timestamp. */
+        gro->rx_time[i] = 0;
+        if (sock->timestamps && (stamp = rx_timestamp(&msgs[i].msg_hdr)) != 0)
+            gro->rx_time[i] = now - (wall > stamp ? wall - stamp : 0);
+    }
+    gro->nmsgs = n;
+    gro->cur   = 0;
+    gro->off   = 0;
+    return n;
+}
+
+/*
+ * Deal out pending segments, reading more until npkts are filled or
+ * the socket has nothing left, so that a short return means the socket
+ * is drained, as with perf_net_recvmmsg() on any other socket.
+ */
+static int gro_recv(struct perf_net_socket* sock, struct perf_net_packet* pkts, unsigned int npkts, int flags)
+{
+    struct perf_net_gro* gro = sock->gro;
+    unsigned int         out;
+    size_t               len;
+    bool                 drained = false;
+    int                  n;
+
+    for (out = 0; out < npkts;) {
+        if (gro->cur == gro->nmsgs) {
+            if (drained)
+                break;
+            n = gro_fill(sock, flags);
+            if (n < 0) {
+                if (out > 0)
+                    break;
+                return -1;
+            }
+            /* A short read emptied the socket queue. */
+            drained = (unsigned int)n < GRO_BUFS;
+        }
+        len = gro->len[gro->cur] - gro->off;
+        if (len > gro->seg[gro->cur])
+            len = gro->seg[gro->cur];
+        memcpy(pkts[out].buf, gro->bufs + gro->cur * GRO_BUFSIZE + gro->off,
+            len < pkts[out].len ? len : pkts[out].len);
+        pkts[out].len     = len < pkts[out].len ? len : pkts[out].len;
+        pkts[out].rx_time = gro->rx_time[gro->cur];
+        out++;
+        gro->off += len;
+        if (gro->off >= gro->len[gro->cur]) {
+            gro->cur++;
+            gro->off = 0;
+        }
+    }
+    return out;
+}
+#else
+int perf_net_gro(struct perf_net_socket* sock)
+{
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+#endif
+
+/*
+ * Receive up to npkts messages into the caller's buffers.  UDP sockets
+ * drain the queue with a single recvmmsg(); stream sockets fall back to
+ * calling perf_net_recv() until nothing more is buffered.  Returns the
+ * number of messages received, or -1 with errno set if there were none.
+ */
+int perf_net_recvmmsg(struct perf_net_socket* sock, struct perf_net_packet* pkts, unsigned int npkts, int flags)
+{
+    struct mmsghdr msgs[PERF_NET_MAX_BATCH];
+    struct iovec   iovs[PERF_NET_MAX_BATCH];
+    unsigned int   i;
+    ssize_t        n;
+    int            ret;
+    uint64_t       now, wall, stamp;
+    union {
+        char           buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } ctls[PERF_NET_MAX_BATCH];
+
+    if (npkts > PERF_NET_MAX_BATCH)
+        npkts = PERF_NET_MAX_BATCH;
+
+#ifdef UDP_GRO
+    if (sock->gro)
+        return gro_recv(sock, pkts, npkts, flags);
+#endif
+
+    switch (sock->mode) {
+    case sock_udp:
+        memset(msgs, 0, npkts * sizeof(*msgs));
+        for (i = 0; i < npkts; i++) {
+            iovs[i].iov_base            = pkts[i].buf;
+            iovs[i].iov_len             = pkts[i].len;
+            msgs[i].msg_hdr.msg_iov    = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            if (sock->timestamps) {
+                msgs[i].msg_hdr.msg_control    = ctls[i].buf;
+                msgs[i].msg_hdr.msg_controllen = sizeof(ctls[i].buf);
+            }
+        }
+        ret = recvmmsg(sock->fd, msgs, npkts, flags, NULL);
+        if (ret < 0)
+            return ret;
+        now = wall = 0;
+        if (sock->timestamps)
+            rx_clock_pair(&now, &wall);
+        for (i = 0; i < (unsigned int)ret; i++) {
+            pkts[i].len     = msgs[i].msg_len;
+            pkts[i].rx_time = 0;
+            if (sock->timestamps && (stamp = rx_timestamp(&msgs[i].msg_hdr)) != 0)
+                pkts[i].rx_time = now - (wall > stamp ? wall - stamp : 0);
+        }
+        return ret;
+    default:
+        break;
+    }
+
+    for (i = 0; i < npkts; i++) {
+        n = perf_net_recv(sock, pkts[i].buf, pkts[i].len, flags);
+        if (n < 0) {
+            if (i == 0)
+                return -1;
+            break;
+        }
+        pkts[i].len     = n;
+        pkts[i].rx_time = 0;
+    }
+    return i;
+}
+
 ssize_t perf_net_sendto(struct perf_net_socket* sock, const void* buf, size_t len, int flags,
     const struct sockaddr* dest_addr, socklen_t addrlen)
 {
@@ -401,8 +897,152 @@ ssize_t perf_net_sendto(struct perf_net_socket* sock, const void* buf, size_t le
     return sendto(sock->fd, buf, len, flags, dest_addr, addrlen);
 }
 
+#ifdef UDP_SEGMENT
+/*
+ * Send a batch as runs of equal-length packets, each run one buffer
+ * that the kernel cuts into gso_size segments; the last packet of a run
+ * may be shorter.  Returns the number of packets sent.
+ */
+static int gso_send(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts, int flags,
+    const struct sockaddr* dest_addr, socklen_t addrlen)
+{
+    struct mmsghdr msgs[PERF_NET_MAX_BATCH];
+    struct iovec   iovs[PERF_NET_MAX_BATCH];
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(uint16_t))];
+    } ctls[PERF_NET_MAX_BATCH];
+    unsigned int    counts[PERF_NET_MAX_BATCH];
+    unsigned int    nmsgs, i, j;
+    size_t          seg, total;
+    struct cmsghdr* cmsg;
+    int             n, sent;
+
+    memset(msgs, 0, npkts * sizeof(*msgs));
+    for (i = 0; i < npkts; i++) {
+        iovs[i].iov_base = pkts[i].buf;
+        iovs[i].iov_len  = pkts[i].len;
+    }
+
+    for (nmsgs = 0, i = 0; i < npkts; i = j, nmsgs++) {
+        seg   = pkts[i].len;
+        total = seg;
+        for (j = i + 1; j < npkts && j - i < GSO_MAX_SEGMENTS; j++) {
+            if (pkts[j].len > seg || total + pkts[j].len > GSO_MAX_BYTES)
+                break;
+            total += pkts[j].len;
+            if (pkts[j].len < seg) {
+                j++;
+                break;
+            }
+        }
+        counts[nmsgs]                   = j - i;
+        msgs[nmsgs].msg_hdr.msg_name    = (void*)dest_addr;
+        msgs[nmsgs].msg_hdr.msg_namelen = addrlen;
+        msgs[nmsgs].msg_hdr.msg_iov     = &iovs[i];
+        msgs[nmsgs].msg_hdr.msg_iovlen  = j - i;
+        if (j - i == 1)
+            continue;
+        msgs[nmsgs].msg_hdr.msg_control    = ctls[nmsgs].buf;
+        msgs[nmsgs].msg_hdr.msg_controllen = sizeof(ctls[nmsgs].buf);
+        cmsg                               = CMSG_FIRSTHDR(&msgs[nmsgs].msg_hdr);
+        cmsg->cmsg_level                   = SOL_UDP;
+        cmsg->cmsg_type                    = UDP_SEGMENT;
+        cmsg->cmsg_len                     = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t*)CMSG_DATA(cmsg)        = seg;
+    }
+
+    n = sendmmsg(sock->fd, msgs, nmsgs, flags);
+    if (n < 0)
+        return -1;
+    for (sent = 0, i = 0; i < (unsigned int)n; i++)
+        sent += counts[i];
+    return sent;
+}
+#endif
+
+/*
+ * Send npkts messages to the same destination.  UDP sockets hand the
+ * whole batch to the kernel with a single sendmmsg(); stream sockets
+ * send one message at a time and stop after a partial write, which
+ * perf_net_sendto() reports as EINPROGRESS and which still counts as
+ * sent.  Returns the number of messages sent, or -1 with errno set if
+ * the first one could not be sent.
+ */
+int perf_net_sendmmsg(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts, int flags,
+    const struct sockaddr* dest_addr, socklen_t addrlen)
+{
+    struct mmsghdr msgs[PERF_NET_MAX_BATCH];
+    struct iovec   iovs[PERF_NET_MAX_BATCH];
+    unsigned int   i;
+    ssize_t        n;
+
+    if (npkts > PERF_NET_MAX_BATCH)
+        npkts = PERF_NET_MAX_BATCH;
+
+#ifdef HAVE_IO_URING
+    if (sock->uring)
+        return uring_send(sock, pkts, npkts);
+#endif
+
+#ifdef HAVE_AF_XDP
+    if (sock->xdp)
+        return xdp_send(sock, pkts, npkts);
+#endif
+
+#ifdef UDP_SEGMENT
+    /* Devices without checksum offload refuse GSO with EIO. */
+    if (sock->gso) {
+        n = gso_send(sock, pkts, npkts, flags, dest_addr, addrlen);
+        if (n >= 0 || (errno != EIO && errno != EINVAL))
+            return n;
+        perf_log_warning("UDP GSO send failed (%s), sending without it", strerror(errno));
+        sock->gso = 0;
+    }
+#endif
+
+    switch (sock->mode) {
+    case sock_udp:
+        memset(msgs, 0, npkts * sizeof(*msgs));
+        for (i = 0; i < npkts; i++) {
+            iovs[i].iov_base             = pkts[i].buf;
+            iovs[i].iov_len              = pkts[i].len;
+            msgs[i].msg_hdr.msg_name    = (void*)dest_addr;
+            msgs[i].msg_hdr.msg_namelen = addrlen;
+            msgs[i].msg_hdr.msg_iov     = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+        }
+        return sendmmsg(sock->fd, msgs, npkts, flags);
+    default:
+        break;
+    }
+
+    for (i = 0; i < npkts; i++) {
+        n = perf_net_sendto(sock, pkts[i].buf, pkts[i].len, flags, dest_addr, addrlen);
+        if (n < 0 && errno == EINPROGRESS)
+            return i + 1;
+        if (n >= 0 && (size_t)n != pkts[i].len) {
+            errno = EMSGSIZE;
+            n     = -1;
+        }
+        if (n < 0) {
+            if (i == 0)
+                return -1;
+            break;
+        }
+    }
+    return i;
+}
+
 int perf_net_close(struct perf_net_socket* sock)
 {
+#ifdef UDP_GRO
+    if (sock->gro) {
+        free(sock->gro->bufs);
+        free(sock->gro);
+        sock->gro = NULL;
+    }
+#endif
     return close(sock->fd);
 }
 
@@ -426,40 +1066,178 @@ enum perf_net_mode perf_net_parsemode(const char* mode)
     exit(1);
 }
 
-int perf_net_sockready(struct perf_net_socket* sock, int pipe_fd, int64_t timeout)
+/*
+ * Parse a transport given as a socket mode with an optional engine
+ * suffix, e.g. "udp" or "udp-uring".
+ */
+enum perf_net_mode perf_net_parsetransport(const char* transport, unsigned int* flags)
 {
-    if (sock->is_ready) {
-        return 1;
+    const char* suffix;
+    char        mode[8];
+
+    *flags = 0;
+    suffix = strchr(transport, '-');
+    if (!suffix)
+        return perf_net_parsemode(transport);
+
+    if (!strcmp(suffix, "-uring")) {
+        *flags |= PERF_NET_URING;
+    } else if (!strcmp(suffix, "-gso")) {
+        *flags |= PERF_NET_GSO;
+    } else if (!strcmp(suffix, "-xdp")) {
+        *flags |= PERF_NET_XDP;
+    } else {
+        perf_log_warning("invalid transport engine");
+        perf_opt_usage();
+        exit(1);
     }
 
-    switch (sock->mode) {
-    case sock_tls: {
-        int ret;
+    snprintf(mode, sizeof(mode), "%.*s", (int)(suffix - transport), transport);
+    return perf_net_parsemode(mode);
+}
 
-        if (sock->sending) {
-            uint16_t dnslen;
-            ssize_t  n;
+/*
+ * Enable UDP GSO sends on a socket, if the kernel has them.
+ */
+int perf_net_gso(struct perf_net_socket* sock)
+{
+#ifdef UDP_SEGMENT
+    int off = 0;
 
-            memcpy(&dnslen, sock->sendbuf, 2);
-            dnslen = ntohs(dnslen);
-            if (pthread_mutex_lock(&sock->lock)) {
-                perf_log_fatal("pthread_mutex_lock() failed");
-            }
-            n = SSL_write(sock->ssl, sock->sendbuf + sock->sending, dnslen + 2 - sock->sending);
-            if (n < 1) {
-                if (n < 0) {
-                    perf_log_warning("SSL_write(): %s", ERR_error_string(SSL_get_error(sock->ssl, n), 0));
-                    errno = EBADF;
-                }
-                if (pthread_mutex_unlock(&sock->lock)) {
-                    perf_log_fatal("pthread_mutex_unlock() failed");
-                }
-                return -1;
-            }
-            if (pthread_mutex_unlock(&sock->lock)) {
-                perf_log_fatal("pthread_mutex_unlock() failed");
-            }
-            sock->sending += n;
+    if (sock->mode != sock_udp || sock->uring) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    /* Probe only; the segment size is passed with every send. */
+    if (setsockopt(sock->fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) < 0)
+        return -1;
+    sock->gso = 1;
+    return 0;
+#else
+    (void)sock;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/*
+ * Make a socket record the CPU its packets are processed on.  The
+ * kernel only does so for connected UDP sockets, so UDP sockets are
+ * connected to the server; sending to an address still works.
+ */
+int perf_net_trackcpu(struct perf_net_socket* sock, const isc_sockaddr_t* server)
+{
+    if (sock->mode != sock_udp)
+        return 0;
+    return connect(sock->fd, &server->type.sa, server->length);
+}
+
+/*
+ * The CPU that processed the last packet received on a socket
+ * (SO_INCOMING_CPU), or -1 if unknown.
+ */
+int perf_net_incomingcpu(const struct perf_net_socket* sock)
+{
+#ifdef SO_INCOMING_CPU
+    int       cpu;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(sock->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+    return cpu;
+#else
+    (void)sock;
+    return -1;
+#endif
+}
+
+/*
+ * Let reads on a socket busy-poll the device queue for up to usec
+ * microseconds (SO_BUSY_POLL) instead of waiting for its interrupt,
+ * and ask the device to defer interrupts meanwhile (SO_PREFER_BUSY_POLL).
+ */
+int perf_net_busypoll(struct perf_net_socket* sock, unsigned int usec)
+{
+#ifdef SO_BUSY_POLL
+    int val = usec;
+
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) < 0)
+        return -1;
+#ifdef SO_PREFER_BUSY_POLL
+    val = 1;
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val)) < 0)
+        return -1;
+#endif
+    return 0;
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+/*
+ * Ask the kernel to stamp every datagram received on a UDP socket;
+ * perf_net_recvmmsg() then reports the stamp as rx_time.
+ */
+int perf_net_rxtimestamps(struct perf_net_socket* sock)
+{
+    int on = 1;
+
+    if (sock->mode != sock_udp || sock->uring) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+#ifdef SO_TIMESTAMPNS
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) {
+        sock->timestamps = 1;
+        return 0;
+    }
+#endif
+    if (setsockopt(sock->fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) == 0) {
+        sock->timestamps = 1;
+        return 0;
+    }
+    return -1;
+}
+
+int perf_net_sockready(struct perf_net_socket* sock, int pipe_fd, int64_t timeout)
+{
+    if (sock->uring && __atomic_load_n(&sock->uring_busy, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    if (sock->is_ready) {
+        return 1;
+    }
+
+    switch (sock->mode) {
+    case sock_tls: {
+        int ret;
+
+        if (sock->sending) {
+            uint16_t dnslen;
+            ssize_t  n;
+
+            memcpy(&dnslen, sock->sendbuf, 2);
+            dnslen = ntohs(dnslen);
+            if (pthread_mutex_lock(&sock->lock)) {
+                perf_log_fatal("pthread_mutex_lock() failed");
+            }
+            n = SSL_write(sock->ssl, sock->sendbuf + sock->sending, dnslen + 2 - sock->sending);
+            if (n < 1) {
+                if (n < 0) {
+                    perf_log_warning("SSL_write(): %s", ERR_error_string(SSL_get_error(sock->ssl, n), 0));
+                    errno = EBADF;
+                }
+                if (pthread_mutex_unlock(&sock->lock)) {
+                    perf_log_fatal("pthread_mutex_unlock() failed");
+                }
+                return -1;
+            }
+            if (pthread_mutex_unlock(&sock->lock)) {
+                perf_log_fatal("pthread_mutex_unlock() failed");
+            }
+            sock->sending += n;
             if (sock->sending < dnslen + 2) {
                 errno = EINPROGRESS;
                 return -1;
@@ -571,3 +1349,1363 @@ int perf_net_sockready(struct perf_net_socket* sock, int pipe_fd, int64_t timeou
 
     return -1;
 }
+
+/*
+ * io_uring engine.  One ring serves all of a thread's sockets: the
+ * sender copies queries into registered send buffers and submits SEND
+ * requests on registered files, and every socket carries one
+ * multishot receive that fills buffers from a provided buffer ring.
+ * Kernels whose SEND cannot take a registered buffer get the same
+ * requests on plain user memory.
+ * The receiver only enters the kernel when it has nothing to reap and
+ * decides to block; the sender enters once per batch, or not at all
+ * with SQPOLL, where a kernel thread picks up submissions.
+ *
+ * The sender owns the send slots and the receiver owns the completion
+ * queue and the buffer ring; the submission queue is shared, since the
+ * receiver re-arms multishot receives that the kernel terminated.
+ */
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 512 /* submission queue entries */
+#define URING_SEND_SLOTS 1024 /* registered send buffers, sends in flight */
+#define URING_RECV_BUFS 1024 /* provided receive buffers, power of 2 */
+#define URING_BUF_SIZE 4096
+#define URING_SLOT_SIZE (URING_BUF_SIZE + 2)
+#define URING_BGID 0
+
+#define URING_OP_RECV 1ULL
+#define URING_OP_SEND 2ULL
+
+#define URING_DATA(op, index, slot) (((op) << 56) | ((uint64_t)(index) << 32) | (slot))
+#define URING_DATA_OP(data) ((data) >> 56)
+#define URING_DATA_INDEX(data) ((unsigned int)((data) >> 32) & 0xFFFFFF)
+#define URING_DATA_SLOT(data) ((unsigned int)(data))
+
+struct perf_net_uring {
+    int                     fd;
+    bool                    sqpoll;
+    pthread_mutex_t         sq_lock;
+
+    void*                   sq_ptr;
+    size_t                  sq_size;
+    void*                   cq_ptr;
+    size_t                  cq_size;
+    struct io_uring_sqe*    sqes;
+    size_t                  sqes_size;
+    unsigned int *          sq_head, *sq_tail, *sq_flags, sq_mask, sq_entries;
+    unsigned int            sq_local_tail;
+    unsigned int *          cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe*    cqes;
+
+    struct perf_net_socket* socks;
+    unsigned int            nsocks;
+    bool                    armed;
+    unsigned int            npending; /* stream sockets with complete messages left in recvbuf */
+
+    unsigned char*          sendbufs;
+    bool                    fixed_send; /* sendbufs registered, SEND takes them */
+    unsigned char*          slot_busy;
+    unsigned int            send_next;
+    uint32_t                send_wake; /* bumped when a send is reaped for a sleeping sender */
+    uint32_t                send_sleeping;
+
+    struct io_uring_buf_ring* br;
+    size_t                    br_size;
+    unsigned char*            recvbufs;
+    unsigned short            br_tail;
+    uint64_t                  ntruncated; /* UDP responses too large for a buffer */
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Must be called with sq_lock held.
+ */
+static struct io_uring_sqe* uring_get_sqe(struct perf_net_uring* ring)
+{
+    struct io_uring_sqe* sqe;
+    unsigned int         head;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+    sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_submit(struct perf_net_uring* ring)
+{
+    unsigned int pending;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (ring->sqpoll) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            uring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+        return;
+    }
+    pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (pending > 0) {
+        int n = uring_enter(ring->fd, pending, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            perf_log_fatal("io_uring_enter: %s", strerror(errno));
+        }
+        pending -= n;
+    }
+}
+
+static void uring_arm_recv(struct perf_net_uring* ring, unsigned int index)
+{
+    struct io_uring_sqe* sqe;
+
+    if (pthread_mutex_lock(&ring->sq_lock)) {
+        perf_log_fatal("pthread_mutex_lock() failed");
+    }
+    while ((sqe = uring_get_sqe(ring)) == NULL)
+        uring_submit(ring);
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->flags     = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->fd        = index;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_DATA(URING_OP_RECV, index, 0);
+    /* So that a datagram larger than its buffer shows its full size. */
+    if (ring->socks[index].mode == sock_udp)
+        sqe->msg_flags = MSG_TRUNC;
+    uring_submit(ring);
+    if (pthread_mutex_unlock(&ring->sq_lock)) {
+        perf_log_fatal("pthread_mutex_unlock() failed");
+    }
+}
+
+static void uring_recycle(struct perf_net_uring* ring, unsigned short bid)
+{
+    struct io_uring_buf* buf;
+
+    buf       = &ring->br->bufs[ring->br_tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (uintptr_t)(ring->recvbufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len  = URING_BUF_SIZE;
+    buf->bid  = bid;
+    ring->br_tail++;
+}
+
+static bool uring_probe(int fd)
+{
+    struct io_uring_probe* probe;
+    size_t                 size;
+    bool                   ok = false;
+
+    size  = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, size);
+    if (!probe)
+        return false;
+    if (uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED))
+        ok = true;
+    free(probe);
+    return ok;
+}
+
+/*
+ * The opcode probe cannot tell whether RECV takes the multishot flag,
+ * so try one on a fresh socket before any buffer group exists: a kernel
+ * that knows the flag fails the request for lack of a buffer, one that
+ * does not rejects it with EINVAL.
+ */
+static bool uring_probe_multishot(struct perf_net_uring* ring)
+{
+    struct io_uring_sqe*          sqe;
+    struct io_uring_cqe*          cqe;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    unsigned int                  head;
+    int                           fd, res;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+    sqe            = uring_get_sqe(ring);
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->fd        = fd;
+    sqe->buf_group = URING_BGID;
+    uring_submit(ring);
+
+    ts.tv_sec  = 1;
+    ts.tv_nsec = 0;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&ts;
+    uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    close(fd);
+
+    /* Still pending means the kernel accepted the request as it is. */
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return true;
+    cqe = &ring->cqes[head & ring->cq_mask];
+    res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res != -EINVAL;
+}
+
+/*
+ * SEND takes a registered buffer only on recent kernels; older ones
+ * reject IORING_RECVSEND_FIXED_BUF with EINVAL.  Try one from the
+ * registered send buffers on a scratch socket pair.
+ */
+static bool uring_probe_fixed_send(struct perf_net_uring* ring)
+{
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+    unsigned int         head;
+    int                  sv[2], res;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0)
+        return false;
+    ring->sendbufs[0] = 0;
+    sqe            = uring_get_sqe(ring);
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = sv[0];
+    sqe->addr      = (uintptr_t)ring->sendbufs;
+    sqe->len       = 1;
+    sqe->ioprio    = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = 0;
+    uring_submit(ring);
+    uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    close(sv[0]);
+    close(sv[1]);
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    cqe = &ring->cqes[head & ring->cq_mask];
+    res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res == 1;
+}
+
+struct perf_net_uring* perf_net_uring_create(struct perf_net_socket* socks, unsigned int nsocks,
+    const isc_sockaddr_t* server, unsigned int flags, const char** reason)
+{
+    struct perf_net_uring*  ring;
+    struct io_uring_params  p;
+    struct io_uring_buf_reg reg;
+    struct iovec            iov;
+    int*                    fds;
+    unsigned int            i;
+
+    for (i = 0; i < nsocks; i++) {
+        if (socks[i].mode != sock_udp && socks[i].mode != sock_tcp) {
+            *reason = "only UDP and TCP are supported";
+            return NULL;
+        }
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        perf_log_fatal("out of memory");
+    ring->fd     = -1;
+    ring->socks  = socks;
+    ring->nsocks = nsocks;
+
+    /*
+     * SQPOLL costs a kernel thread per ring, so it is only tried on
+     * request, and dropped if the kernel refuses it.
+     */
+    if (flags & PERF_NET_URING_SQPOLL) {
+        memset(&p, 0, sizeof(p));
+        p.flags          = IORING_SETUP_SQPOLL | IORING_SETUP_CQSIZE;
+        p.sq_thread_idle = 100;
+        p.cq_entries     = URING_SEND_SLOTS + URING_RECV_BUFS;
+        ring->fd         = uring_setup(URING_ENTRIES, &p);
+        if (ring->fd >= 0)
+            ring->sqpoll = true;
+        else
+            perf_log_warning("io_uring SQPOLL unavailable: %s", strerror(errno));
+    }
+    if (ring->fd < 0) {
+        memset(&p, 0, sizeof(p));
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_SEND_SLOTS + URING_RECV_BUFS;
+        ring->fd     = uring_setup(URING_ENTRIES, &p);
+    }
+    if (ring->fd < 0) {
+        *reason = strerror(errno);
+        goto fail;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG) || !uring_probe(ring->fd)) {
+        *reason = "kernel lacks the needed io_uring features";
+        goto fail;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        *reason      = strerror(errno);
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            *reason      = strerror(errno);
+            goto fail;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes      = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        *reason    = strerror(errno);
+        goto fail;
+    }
+
+    ring->sq_head    = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail    = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_flags   = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.flags);
+    ring->sq_mask    = *(unsigned int*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    for (i = 0; i < p.sq_entries; i++)
+        ((unsigned int*)((char*)ring->sq_ptr + p.sq_off.array))[i] = i;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head       = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail       = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask       = *(unsigned int*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes          = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+    if (!uring_probe_multishot(ring)) {
+        *reason = "kernel lacks multishot receive";
+        goto fail;
+    }
+
+    fds = calloc(nsocks, sizeof(*fds));
+    if (!fds)
+        perf_log_fatal("out of memory");
+    for (i = 0; i < nsocks; i++)
+        fds[i] = socks[i].fd;
+    if (uring_register(ring->fd, IORING_REGISTER_FILES, fds, nsocks) < 0) {
+        free(fds);
+        *reason = strerror(errno);
+        goto fail;
+    }
+    free(fds);
+
+    ring->slot_busy = calloc(URING_SEND_SLOTS, 1);
+    if (!ring->slot_busy || posix_memalign((void**)&ring->sendbufs, 4096, URING_SEND_SLOTS * URING_SLOT_SIZE)
+        || posix_memalign((void**)&ring->recvbufs, 4096, (size_t)URING_RECV_BUFS * URING_BUF_SIZE))
+        perf_log_fatal("out of memory");
+
+    /*
+     * Registering pins the send buffers once, instead of on every send.
+     * It is only an optimisation: without kernel support for it, or past
+     * the locked memory limit, the sends use the buffers unregistered.
+     */
+    iov.iov_base = ring->sendbufs;
+    iov.iov_len  = URING_SEND_SLOTS * URING_SLOT_SIZE;
+    if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+        ring->fixed_send = uring_probe_fixed_send(ring);
+
+    ring->br_size = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    ring->br      = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        *reason  = strerror(errno);
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uintptr_t)ring->br;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid         = URING_BGID;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        *reason = strerror(errno);
+        goto fail;
+    }
+    for (i = 0; i < URING_RECV_BUFS; i++)
+        uring_recycle(ring, i);
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+
+    if (pthread_mutex_init(&ring->sq_lock, 0)) {
+        perf_log_fatal("pthread_mutex_init() failed");
+    }
+
+    /*
+     * Past this point the sockets are committed to the ring, and UDP
+     * sockets are connected so that plain sends reach the server.  They
+     * stay nonblocking: the ring polls a socket whose buffer is full
+     * and retries the send, where a write would have failed it.
+     */
+    for (i = 0; i < nsocks; i++) {
+        if (socks[i].mode == sock_udp && connect(socks[i].fd, &server->type.sa, server->length))
+            perf_log_fatal("connect() failed: %s", strerror(errno));
+        socks[i].uring       = ring;
+        socks[i].uring_index = i;
+        socks[i].uring_busy  = 0;
+    }
+
+    return ring;
+
+fail:
+    if (ring->br)
+        munmap(ring->br, ring->br_size);
+    free(ring->recvbufs);
+    free(ring->sendbufs);
+    free(ring->slot_busy);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void perf_net_uring_destroy(struct perf_net_uring* ring)
+{
+    unsigned int i;
+
+    for (i = 0; i < ring->nsocks; i++)
+        ring->socks[i].uring = NULL;
+    close(ring->fd);
+    munmap(ring->br, ring->br_size);
+    free(ring->recvbufs);
+    free(ring->sendbufs);
+    free(ring->slot_busy);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    pthread_mutex_destroy(&ring->sq_lock);
+    free(ring);
+}
+
+/*
+ * Queue npkts messages on one socket.  Stream sockets get the DNS
+ * length prefix and are marked busy until the write completes, which
+ * keeps their byte stream in order.  Returns the number queued, or -1
+ * with errno set to EAGAIN if no send slot or queue entry was free.
+ */
+static int uring_send(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts)
+{
+    struct perf_net_uring* ring = sock->uring;
+    struct io_uring_sqe*   sqe;
+    unsigned char*         buf;
+    unsigned int           i, slot;
+    size_t                 len;
+    uint16_t               dnslen;
+
+    errno = EAGAIN;
+    if (pthread_mutex_lock(&ring->sq_lock)) {
+        perf_log_fatal("pthread_mutex_lock() failed");
+    }
+    for (i = 0; i < npkts; i++) {
+        slot = ring->send_next;
+        if (__atomic_load_n(&ring->slot_busy[slot], __ATOMIC_ACQUIRE))
+            break;
+        len = pkts[i].len + (sock->mode == sock_tcp ? 2 : 0);
+        if (len > URING_SLOT_SIZE) {
+            errno = EMSGSIZE;
+            break;
+        }
+        if ((sqe = uring_get_sqe(ring)) == NULL)
+            break;
+
+        buf = ring->sendbufs + (size_t)slot * URING_SLOT_SIZE;
+        if (sock->mode == sock_tcp) {
+            dnslen = htons(pkts[i].len);
+            memcpy(buf, &dnslen, 2);
+            memcpy(buf + 2, pkts[i].buf, pkts[i].len);
+        } else {
+            memcpy(buf, pkts[i].buf, len);
+        }
+        ring->slot_busy[slot] = 1;
+        ring->send_next       = (slot + 1) % URING_SEND_SLOTS;
+
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->flags     = IOSQE_FIXED_FILE;
+        sqe->fd        = sock->uring_index;
+        sqe->addr      = (uintptr_t)buf;
+        sqe->len       = len;
+        sqe->msg_flags = sock->mode == sock_tcp ? MSG_WAITALL : 0;
+        if (ring->fixed_send) {
+            sqe->ioprio    = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = 0;
+        }
+        sqe->user_data = URING_DATA(URING_OP_SEND, sock->uring_index, slot);
+    }
+    if (i > 0) {
+        if (sock->mode == sock_tcp)
+            __atomic_store_n(&sock->uring_busy, 1, __ATOMIC_RELEASE);
+        uring_submit(ring);
+    }
+    if (pthread_mutex_unlock(&ring->sq_lock)) {
+        perf_log_fatal("pthread_mutex_unlock() failed");
+    }
+    return i > 0 ? (int)i : -1;
+}
+
+/*
+ * Move complete DNS messages from a stream socket's receive buffer into
+ * pkts, returning the new packet count.
+ */
+static unsigned int uring_frames(struct perf_net_uring* ring, unsigned int index,
+    struct perf_net_packet* pkts, unsigned int* which, unsigned int n, unsigned int npkts)
+{
+    struct perf_net_socket* sock = &ring->socks[index];
+    uint16_t                dnslen;
+    size_t                  len;
+
+    while (n < npkts && sock->at >= 2) {
+        memcpy(&dnslen, sock->recvbuf, 2);
+        dnslen = ntohs(dnslen);
+        if (sock->at < dnslen + 2u)
+            break;
+        len = dnslen < pkts[n].len ? dnslen : pkts[n].len;
+        memcpy(pkts[n].buf, sock->recvbuf + 2, len);
+        pkts[n].len     = len;
+        pkts[n].rx_time = 0;
+        which[n++]      = index;
+        memmove(sock->recvbuf, sock->recvbuf + dnslen + 2, sock->at - dnslen - 2);
+        sock->at -= dnslen + 2;
+    }
+
+    if (sock->at >= 2) {
+        memcpy(&dnslen, sock->recvbuf, 2);
+        dnslen = ntohs(dnslen);
+        if (sock->at >= dnslen + 2u) {
+            if (!sock->have_more)
+                ring->npending++;
+            sock->have_more = 1;
+            return n;
+        }
+    }
+    if (sock->have_more)
+        ring->npending--;
+    sock->have_more = 0;
+    return n;
+}
+
+/*
+ * Reap up to npkts received messages from the ring without blocking,
+ * storing each one's socket index in which[].  Send completions found
+ * along the way release their slots.  UDP responses that did not fit
+ * a buffer are dropped and counted, see perf_net_uring_truncated().
+ * Returns the number of messages, or -1 with errno set if a receive
+ * failed.
+ */
+int perf_net_uring_recv(struct perf_net_uring* ring, struct perf_net_packet* pkts, unsigned int* which, unsigned int npkts)
+{
+    struct io_uring_cqe*    cqe;
+    struct perf_net_socket* sock;
+    unsigned int            head, tail, n = 0, i, index;
+    unsigned short          bid;
+    unsigned char*          buf;
+    size_t                  len;
+    int                     error = 0;
+    bool                    reaped_send = false;
+
+    if (!ring->armed) {
+        /*
+         * Armed from the receiving thread, so that in the non-SQPOLL
+         * case the receive work runs in the context that reaps it.
+         */
+        for (i = 0; i < ring->nsocks; i++)
+            uring_arm_recv(ring, i);
+        ring->armed = true;
+    }
+
+    for (i = 0; ring->npending > 0 && i < ring->nsocks && n < npkts; i++) {
+        if (ring->socks[i].have_more)
+            n = uring_frames(ring, i, pkts, which, n, npkts);
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n < npkts && !error; head++) {
+        cqe   = &ring->cqes[head & ring->cq_mask];
+        index = URING_DATA_INDEX(cqe->user_data);
+        sock  = &ring->socks[index];
+
+        if (URING_DATA_OP(cqe->user_data) == URING_OP_SEND) {
+            if (cqe->res < 0 && cqe->res != -ECONNREFUSED)
+                perf_log_warning("failed to send packet: %s", strerror(-cqe->res));
+            __atomic_store_n(&ring->slot_busy[URING_DATA_SLOT(cqe->user_data)], 0, __ATOMIC_RELEASE);
+            if (sock->mode == sock_tcp)
+                __atomic_store_n(&sock->uring_busy, 0, __ATOMIC_RELEASE);
+            reaped_send = true;
+            continue;
+        }
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            buf = ring->recvbufs + (size_t)bid * URING_BUF_SIZE;
+            if (cqe->res > 0 && sock->mode == sock_tcp) {
+                if (sock->at + cqe->res > TCP_RECV_BUF_SIZE)
+                    perf_log_fatal("TCP receive buffer overflow");
+                memcpy(sock->recvbuf + sock->at, buf, cqe->res);
+                sock->at += cqe->res;
+                n = uring_frames(ring, index, pkts, which, n, npkts);
+            } else if (cqe->res > URING_BUF_SIZE || (size_t)cqe->res > pkts[n].len) {
+                ring->ntruncated++;
+            } else if (cqe->res > 0) {
+                len = cqe->res;
+                memcpy(pkts[n].buf, buf, len);
+                pkts[n].len     = len;
+                pkts[n].rx_time = 0;
+                which[n++]      = index;
+            }
+            uring_recycle(ring, bid);
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            if (cqe->res == 0 && sock->mode == sock_tcp) {
+                perf_log_warning("connection closed by server");
+                continue;
+            }
+            if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECONNREFUSED && cqe->res != -EINTR) {
+                error = -cqe->res;
+                continue;
+            }
+            uring_arm_recv(ring, index);
+        }
+    }
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (reaped_send) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->send_sleeping, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&ring->send_wake, 1, __ATOMIC_SEQ_CST);
+            perf_os_wake(&ring->send_wake);
+        }
+    }
+
+    if (n == 0 && error) {
+        errno = error;
+        return -1;
+    }
+    return n;
+}
+
+uint64_t perf_net_uring_truncated(const struct perf_net_uring* ring)
+{
+    return ring->ntruncated;
+}
+
+/*
+ * Block until the ring has a completion to reap or the timeout (in
+ * microseconds) expires.
+ */
+void perf_net_uring_wait(struct perf_net_uring* ring, int64_t timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+
+    if (ring->npending > 0 || *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return;
+
+    ts.tv_sec  = timeout / 1000000;
+    ts.tv_nsec = (timeout % 1000000) * 1000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&ts;
+    uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/*
+ * Sender side: how many of npkts messages uring_send() would take now.
+ * Send slots only come free as the receiver reaps the completions of
+ * earlier sends, so a full ring is backpressure rather than an error.
+ */
+unsigned int perf_net_uring_sendroom(struct perf_net_uring* ring, unsigned int npkts)
+{
+    unsigned int i, free_sqes;
+
+    if (pthread_mutex_lock(&ring->sq_lock)) {
+        perf_log_fatal("pthread_mutex_lock() failed");
+    }
+    free_sqes = ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+    if (pthread_mutex_unlock(&ring->sq_lock)) {
+        perf_log_fatal("pthread_mutex_unlock() failed");
+    }
+    if (npkts > free_sqes)
+        npkts = free_sqes;
+    for (i = 0; i < npkts; i++) {
+        if (__atomic_load_n(&ring->slot_busy[(ring->send_next + i) % URING_SEND_SLOTS], __ATOMIC_ACQUIRE))
+            break;
+    }
+    return i;
+}
+
+/*
+ * Whether no socket of the ring can be sent on: the next send slot is
+ * still in flight, or every socket is a stream with a write pending.
+ */
+static bool uring_send_blocked(struct perf_net_uring* ring)
+{
+    unsigned int i;
+
+    if (__atomic_load_n(&ring->slot_busy[ring->send_next], __ATOMIC_ACQUIRE))
+        return true;
+    for (i = 0; i < ring->nsocks; i++) {
+        if (!__atomic_load_n(&ring->socks[i].uring_busy, __ATOMIC_ACQUIRE))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Sender side: sleep until the receiver reaps a send completion, or
+ * with SQPOLL until the kernel thread makes room in the submission
+ * queue, for at most timeout microseconds.
+ */
+void perf_net_uring_sendwait(struct perf_net_uring* ring, int64_t timeout)
+{
+    struct timespec ts;
+    uint32_t        wake;
+
+    perf_os_clock_totimespec(perf_os_clock_now() + (uint64_t)timeout * 1000, &ts);
+    wake = __atomic_load_n(&ring->send_wake, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->send_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (uring_send_blocked(ring))
+        perf_os_wait(&ring->send_wake, wake, &ts);
+    else if (ring->sqpoll && perf_net_uring_sendroom(ring, 1) == 0)
+        uring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAIT, NULL, 0);
+    __atomic_store_n(&ring->send_sleeping, 0, __ATOMIC_RELAXED);
+}
+
+#else
+
+struct perf_net_uring* perf_net_uring_create(struct perf_net_socket* socks, unsigned int nsocks,
+    const isc_sockaddr_t* server, unsigned int flags, const char** reason)
+{
+    *reason = "not built with io_uring support";
+    return NULL;
+}
+
+void perf_net_uring_destroy(struct perf_net_uring* ring)
+{
+}
+
+int perf_net_uring_recv(struct perf_net_uring* ring, struct perf_net_packet* pkts, unsigned int* which, unsigned int npkts)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+uint64_t perf_net_uring_truncated(const struct perf_net_uring* ring)
+{
+    return 0;
+}
+
+void perf_net_uring_wait(struct perf_net_uring* ring, int64_t timeout)
+{
+}
+
+unsigned int perf_net_uring_sendroom(struct perf_net_uring* ring, unsigned int npkts)
+{
+    return 0;
+}
+
+void perf_net_uring_sendwait(struct perf_net_uring* ring, int64_t timeout)
+{
+}
+
+#endif
+
+#ifdef HAVE_AF_XDP
+
+/*
+ * AF_XDP engine.  Queries are written as complete Ethernet/IPv4/UDP
+ * frames into a UMEM shared with the kernel and handed to the device
+ * through the TX ring; an XDP program on the interface redirects the
+ * server's responses to the RX ring, where they are parsed in place.
+ * The kernel UDP sockets stay open only to own the source ports.
+ *
+ * The UMEM is split in two: the first half of the frames cycles through
+ * the fill and RX rings and belongs to the receiver, the second half
+ * through the TX and completion rings and belongs to the sender, so the
+ * two threads never share a ring.
+ */
+#define XDP_FRAME_SIZE 4096
+#define XDP_NUM_FRAMES 4096
+#define XDP_RX_FRAMES (XDP_NUM_FRAMES / 2)
+#define XDP_RING_SIZE 2048
+#define XDP_HDR_LEN (14 + 20 + 8)
+#define XDP_MAX_PAYLOAD (1500 - 20 - 8)
+#define XDP_MAP_ENTRIES 64
+
+struct xdp_ring {
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    void*     descs;
+    void*     map;
+    size_t    map_len;
+};
+
+struct perf_net_xdp {
+    int                     fd;
+    unsigned char*          umem;
+    struct xdp_ring         rx, tx, fill, comp;
+    uint64_t                tx_free[XDP_NUM_FRAMES - XDP_RX_FRAMES];
+    unsigned int            ntx_free;
+    unsigned char           hdr[XDP_HDR_LEN];
+    uint16_t                ip_id;
+    uint32_t                saddr, daddr;
+    uint16_t                dport;
+    uint16_t*               ports; /* source port of each socket, network order */
+    uint16_t*               portmap; /* local port -> socket index + 1 */
+    struct perf_net_socket* socks;
+    unsigned int            nsocks;
+};
+
+/*
+ * The XDP program and its XSKMAP are per interface and shared by the
+ * threads; the link detaches the program when the last thread is done.
+ */
+static struct {
+    int          ifindex;
+    int          map_fd, prog_fd, link_fd;
+    unsigned int refs;
+} xdp_prog = { 0, -1, -1, -1, 0 };
+
+static int xdp_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define XDP_INSN(c, d, s, o, i) ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/*
+ * Redirect IPv4 UDP packets from the server port to the socket bound on
+ * the receive queue, and pass everything else (ARP above all) on to the
+ * kernel.
+ */
+static int xdp_attach(int ifindex, uint16_t sport, bool native, const char** reason)
+{
+    union bpf_attr attr;
+    static char    license[] = "Dual BSD/GPL";
+    int            map_fd, prog_fd, link_fd;
+
+    struct bpf_insn insns[] = {
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0), /* r6 = ctx */
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 1, offsetof(struct xdp_md, data), 0),
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 1, offsetof(struct xdp_md, data_end), 0),
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HDR_LEN),
+        XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 14, 0), /* short frame */
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0),
+        XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 12, htons(ETH_P_IP)),
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 14, 0),
+        XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 10, 0x45), /* no IP options */
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 23, 0),
+        XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 8, IPPROTO_UDP),
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 34, 0),
+        XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 6, sport),
+        XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+        XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, 0), /* r1 = map */
+        XDP_INSN(0, 0, 0, 0, 0),
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+        XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS), /* pass: */
+        XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(uint32_t);
+    attr.value_size  = sizeof(uint32_t);
+    attr.max_entries = XDP_MAP_ENTRIES;
+    if ((map_fd = xdp_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        *reason = "cannot create XSKMAP";
+        return -1;
+    }
+    insns[15].imm = map_fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns     = (uintptr_t)insns;
+    attr.insn_cnt  = sizeof(insns) / sizeof(insns[0]);
+    attr.license   = (uintptr_t)license;
+    if ((prog_fd = xdp_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+        *reason = "cannot load XDP program";
+        close(map_fd);
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    if ((link_fd = xdp_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+        *reason = errno == EBUSY ? "interface already has an XDP program" : "cannot attach XDP program";
+        close(prog_fd);
+        close(map_fd);
+        return -1;
+    }
+
+    xdp_prog.ifindex = ifindex;
+    xdp_prog.map_fd  = map_fd;
+    xdp_prog.prog_fd = prog_fd;
+    xdp_prog.link_fd = link_fd;
+    return 0;
+}
+
+static void xdp_detach(void)
+{
+    if (--xdp_prog.refs > 0)
+        return;
+    close(xdp_prog.link_fd);
+    close(xdp_prog.prog_fd);
+    close(xdp_prog.map_fd);
+    xdp_prog.map_fd = xdp_prog.prog_fd = xdp_prog.link_fd = -1;
+}
+
+static int xdp_parsemac(const char* str, unsigned char* mac)
+{
+    unsigned int b[6];
+    int          i;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return -1;
+    for (i = 0; i < 6; i++)
+        mac[i] = b[i];
+    return 0;
+}
+
+/*
+ * Find the server's MAC in the neighbour table, prodding the kernel into
+ * resolving it with an empty datagram to the discard port if needed.
+ * Only on-link servers can be found this way.
+ */
+static int xdp_neighbour(int fd, const char* ifname, uint32_t addr, unsigned char* mac)
+{
+    struct sockaddr_in sin;
+    char               line[256], ip[64], hw[64], dev[IF_NAMESIZE + 1];
+    unsigned int       flags;
+    FILE*              f;
+    int                tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        if ((f = fopen("/proc/net/arp", "r")) == NULL)
+            return -1;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%63s %*s %x %63s %*s %16s", ip, &flags, hw, dev) != 4)
+                continue;
+            if (inet_addr(ip) == addr && (flags & ATF_COM) && !strcmp(dev, ifname) && !xdp_parsemac(hw, mac)) {
+                fclose(f);
+                return 0;
+            }
+        }
+        fclose(f);
+        if (tries == 0) {
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family      = AF_INET;
+            sin.sin_addr.s_addr = addr;
+            sin.sin_port        = htons(9);
+            sendto(fd, "", 0, 0, (struct sockaddr*)&sin, sizeof(sin));
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int xdp_mapring(struct perf_net_xdp* xdp, struct xdp_ring* ring, const struct xdp_ring_offset* off,
+    size_t descsize, off_t pgoff)
+{
+    ring->map_len = off->desc + XDP_RING_SIZE * descsize;
+    ring->map     = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xdp->fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t*)((char*)ring->map + off->producer);
+    ring->consumer = (uint32_t*)((char*)ring->map + off->consumer);
+    ring->flags    = (uint32_t*)((char*)ring->map + off->flags);
+    ring->descs    = (char*)ring->map + off->desc;
+    return 0;
+}
+
+static uint16_t xdp_ipsum(const unsigned char* hdr)
+{
+    uint32_t sum = 0;
+    int      i;
+
+    for (i = 0; i < 20; i += 2)
+        sum += (hdr[i] << 8) | hdr[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+struct perf_net_xdp* perf_net_xdp_create(struct perf_net_socket* socks, unsigned int nsocks,
+    const isc_sockaddr_t* server, const isc_sockaddr_t* local, const struct perf_net_xdpconf* conf,
+    const char** reason)
+{
+    struct perf_net_xdp*    xdp;
+    struct xdp_umem_reg     reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp     sxdp;
+    struct sockaddr_in      sin;
+    struct ifreq            ifr;
+    socklen_t               len;
+    unsigned char           smac[6], dmac[6];
+    uint32_t                key;
+    int                     ifindex, size, i;
+    union bpf_attr          attr;
+
+    if (isc_sockaddr_pf(server) != AF_INET) {
+        *reason = "IPv4 only";
+        return NULL;
+    }
+    if ((ifindex = if_nametoindex(conf->ifname)) == 0) {
+        *reason = "unknown interface";
+        return NULL;
+    }
+    if (xdp_prog.refs > 0 && xdp_prog.ifindex != ifindex) {
+        *reason = "all threads must use one interface";
+        return NULL;
+    }
+
+    xdp = calloc(1, sizeof(*xdp));
+    if (!xdp)
+        perf_log_fatal("out of memory");
+    xdp->fd      = -1;
+    xdp->socks   = socks;
+    xdp->nsocks  = nsocks;
+    xdp->daddr   = server->type.sin.sin_addr.s_addr;
+    xdp->dport   = server->type.sin.sin_port;
+    xdp->ports   = calloc(nsocks, sizeof(*xdp->ports));
+    xdp->portmap = calloc(65536, sizeof(*xdp->portmap));
+    if (!xdp->ports || !xdp->portmap)
+        perf_log_fatal("out of memory");
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", conf->ifname);
+    if (ioctl(socks[0].fd, SIOCGIFHWADDR, &ifr) < 0) {
+        *reason = "cannot read interface MAC";
+        goto fail;
+    }
+    memcpy(smac, ifr.ifr_hwaddr.sa_data, 6);
+    xdp->saddr = local->type.sin.sin_addr.s_addr;
+    if (xdp->saddr == INADDR_ANY) {
+        if (ioctl(socks[0].fd, SIOCGIFADDR, &ifr) < 0) {
+            *reason = "interface has no IPv4 address";
+            goto fail;
+        }
+        xdp->saddr = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr;
+    }
+    if (conf->dmac ? xdp_parsemac(conf->dmac, dmac) : xdp_neighbour(socks[0].fd, conf->ifname, xdp->daddr, dmac)) {
+        *reason = conf->dmac ? "invalid MAC address" : "server MAC not found, set it with -O xdp-dmac";
+        goto fail;
+    }
+    for (i = 0; i < (int)nsocks; i++) {
+        len = sizeof(sin);
+        if (getsockname(socks[i].fd, (struct sockaddr*)&sin, &len) < 0 || sin.sin_family != AF_INET) {
+            *reason = "cannot read socket port";
+            goto fail;
+        }
+        xdp->ports[i]                      = sin.sin_port;
+        xdp->portmap[ntohs(sin.sin_port)] = i + 1;
+    }
+
+    /* Frame template: Ethernet, IPv4 (DF, no options), UDP without checksum */
+    memcpy(xdp->hdr, dmac, 6);
+    memcpy(xdp->hdr + 6, smac, 6);
+    xdp->hdr[12] = ETH_P_IP >> 8;
+    xdp->hdr[13] = ETH_P_IP & 0xff;
+    xdp->hdr[14] = 0x45;
+    xdp->hdr[20] = 0x40;
+    xdp->hdr[22] = 64;
+    xdp->hdr[23] = IPPROTO_UDP;
+    memcpy(xdp->hdr + 26, &xdp->saddr, 4);
+    memcpy(xdp->hdr + 30, &xdp->daddr, 4);
+    memcpy(xdp->hdr + 36, &xdp->dport, 2);
+
+    if ((xdp->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        *reason = strerror(errno);
+        goto fail;
+    }
+    if (posix_memalign((void**)&xdp->umem, getpagesize(), (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE))
+        perf_log_fatal("out of memory");
+    memset(&reg, 0, sizeof(reg));
+    reg.addr       = (uintptr_t)xdp->umem;
+    reg.len        = (uint64_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    size           = XDP_RING_SIZE;
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0
+        || setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0
+        || setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0
+        || setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0
+        || setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+        *reason = strerror(errno);
+        goto fail;
+    }
+    len = sizeof(off);
+    if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0
+        || xdp_mapring(xdp, &xdp->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0
+        || xdp_mapring(xdp, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0
+        || xdp_mapring(xdp, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0
+        || xdp_mapring(xdp, &xdp->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0) {
+        *reason = strerror(errno);
+        goto fail;
+    }
+
+    for (i = 0; i < XDP_RX_FRAMES; i++)
+        ((uint64_t*)xdp->fill.descs)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    __atomic_store_n(xdp->fill.producer, XDP_RX_FRAMES, __ATOMIC_RELEASE);
+    for (i = XDP_RX_FRAMES; i < XDP_NUM_FRAMES; i++)
+        xdp->tx_free[xdp->ntx_free++] = (uint64_t)i * XDP_FRAME_SIZE;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family   = AF_XDP;
+    sxdp.sxdp_ifindex  = ifindex;
+    sxdp.sxdp_queue_id = conf->queue;
+    sxdp.sxdp_flags    = XDP_USE_NEED_WAKEUP | (conf->native ? XDP_ZEROCOPY : XDP_COPY);
+    if (bind(xdp->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) < 0) {
+        if (!conf->native) {
+            *reason = strerror(errno);
+            goto fail;
+        }
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        if (bind(xdp->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) < 0) {
+            *reason = strerror(errno);
+            goto fail;
+        }
+        perf_log_warning("AF_XDP zero-copy unavailable on %s, copying", conf->ifname);
+    }
+
+    if (xdp_prog.refs == 0 && xdp_attach(ifindex, xdp->dport, conf->native, reason) < 0)
+        goto fail;
+    xdp_prog.refs++;
+    key = conf->queue;
+    i   = xdp->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp_prog.map_fd;
+    attr.key    = (uintptr_t)&key;
+    attr.value  = (uintptr_t)&i;
+    if (conf->queue >= XDP_MAP_ENTRIES || xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        *reason = "cannot add socket to XSKMAP";
+        xdp_detach();
+        goto fail;
+    }
+
+    for (i = 0; i < (int)nsocks; i++) {
+        socks[i].xdp       = xdp;
+        socks[i].xdp_index = i;
+    }
+    return xdp;
+
+fail:
+    if (xdp->comp.map)
+        munmap(xdp->comp.map, xdp->comp.map_len);
+    if (xdp->fill.map)
+        munmap(xdp->fill.map, xdp->fill.map_len);
+    if (xdp->tx.map)
+        munmap(xdp->tx.map, xdp->tx.map_len);
+    if (xdp->rx.map)
+        munmap(xdp->rx.map, xdp->rx.map_len);
+    if (xdp->fd >= 0)
+        close(xdp->fd);
+    free(xdp->umem);
+    free(xdp->portmap);
+    free(xdp->ports);
+    free(xdp);
+    return NULL;
+}
+
+void perf_net_xdp_destroy(struct perf_net_xdp* xdp)
+{
+    unsigned int i;
+
+    if (!xdp)
+        return;
+    for (i = 0; i < xdp->nsocks; i++)
+        xdp->socks[i].xdp = NULL;
+    xdp_detach();
+    munmap(xdp->comp.map, xdp->comp.map_len);
+    munmap(xdp->fill.map, xdp->fill.map_len);
+    munmap(xdp->tx.map, xdp->tx.map_len);
+    munmap(xdp->rx.map, xdp->rx.map_len);
+    close(xdp->fd);
+    free(xdp->umem);
+    free(xdp->portmap);
+    free(xdp->ports);
+    free(xdp);
+}
+
+/*
+ * Write the queries as frames onto the TX ring.  Returns the number
+ * queued, which is short when the ring or the frame pool runs out.
+ */
+static int xdp_send(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts)
+{
+    struct perf_net_xdp* xdp = sock->xdp;
+    struct xdp_desc*     descs = xdp->tx.descs;
+    uint64_t*            comp = xdp->comp.descs;
+    uint32_t             prod, cons, n, i;
+    unsigned char*       frame;
+    uint16_t             len;
+
+    /* Reap frames the device is done with */
+    cons = *xdp->comp.consumer;
+    prod = __atomic_load_n(xdp->comp.producer, __ATOMIC_ACQUIRE);
+    for (; cons != prod; cons++)
+        xdp->tx_free[xdp->ntx_free++] = comp[cons & (XDP_RING_SIZE - 1)];
+    __atomic_store_n(xdp->comp.consumer, cons, __ATOMIC_RELEASE);
+
+    prod = *xdp->tx.producer;
+    cons = __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE);
+    n    = XDP_RING_SIZE - (prod - cons);
+    if (n > npkts)
+        n = npkts;
+    if (n > xdp->ntx_free)
+        n = xdp->ntx_free;
+
+    for (i = 0; i < n; i++) {
+        if (pkts[i].len > XDP_MAX_PAYLOAD) {
+            if (i == 0) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            break;
+        }
+        descs[(prod + i) & (XDP_RING_SIZE - 1)].addr    = xdp->tx_free[--xdp->ntx_free];
+        frame                                           = xdp->umem + descs[(prod + i) & (XDP_RING_SIZE - 1)].addr;
+        descs[(prod + i) & (XDP_RING_SIZE - 1)].len     = XDP_HDR_LEN + pkts[i].len;
+        descs[(prod + i) & (XDP_RING_SIZE - 1)].options = 0;
+
+        memcpy(frame, xdp->hdr, XDP_HDR_LEN);
+        len = htons(20 + 8 + pkts[i].len);
+        memcpy(frame + 16, &len, 2);
+        len = htons(xdp->ip_id++);
+        memcpy(frame + 18, &len, 2);
+        len = xdp_ipsum(frame + 14);
+        memcpy(frame + 24, &len, 2);
+        memcpy(frame + 34, &xdp->ports[sock->xdp_index], 2);
+        len = htons(8 + pkts[i].len);
+        memcpy(frame + 38, &len, 2);
+        memcpy(frame + XDP_HDR_LEN, pkts[i].buf, pkts[i].len);
+    }
+    n = i;
+    if (n == 0)
+        return 0;
+
+    __atomic_store_n(xdp->tx.producer, prod + n, __ATOMIC_RELEASE);
+    if (__atomic_load_n(xdp->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    return n;
+}
+
+int perf_net_xdp_recv(struct perf_net_xdp* xdp, struct perf_net_packet* pkts, unsigned int* which, unsigned int npkts)
+{
+    struct xdp_desc* descs = xdp->rx.descs;
+    uint64_t*        fill  = xdp->fill.descs;
+    uint32_t         prod, cons, fprod, n;
+    const unsigned char* frame;
+    uint16_t         port, len;
+    unsigned int     index;
+
+    cons = *xdp->rx.consumer;
+    prod = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    fprod = *xdp->fill.producer;
+    n     = 0;
+    for (; cons != prod && n < npkts; cons++) {
+        const struct xdp_desc* d = &descs[cons & (XDP_RING_SIZE - 1)];
+
+        frame = xdp->umem + d->addr;
+        memcpy(&port, frame + 36, 2);
+        memcpy(&len, frame + 38, 2);
+        len   = ntohs(len);
+        index = xdp->portmap[ntohs(port)];
+        if (index != 0 && len >= 8 && d->len >= 34u + len && !memcmp(frame + 26, &xdp->daddr, 4)) {
+            len -= 8;
+            pkts[n].len = len < pkts[n].len ? len : pkts[n].len;
+            memcpy(pkts[n].buf, frame + XDP_HDR_LEN, pkts[n].len);
+            pkts[n].rx_time = 0;
+            which[n++]      = index - 1;
+        }
+        /* The frame goes straight back to the kernel */
+        fill[fprod++ & (XDP_RING_SIZE - 1)] = d->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(xdp->rx.consumer, cons, __ATOMIC_RELEASE);
+    __atomic_store_n(xdp->fill.producer, fprod, __ATOMIC_RELEASE);
+    if (__atomic_load_n(xdp->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        recvfrom(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    return n;
+}
+
+/*
+ * Block until the RX ring has a frame or the timeout (in microseconds)
+ * expires.
+ */
+void perf_net_xdp_wait(struct perf_net_xdp* xdp, int64_t timeout)
+{
+    struct pollfd pfd;
+
+    if (*xdp->rx.consumer != __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE))
+        return;
+    pfd.fd     = xdp->fd;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, (timeout + 999) / 1000);
+}
+
+#else
+
+struct perf_net_xdp* perf_net_xdp_create(struct perf_net_socket* socks, unsigned int nsocks,
+    const isc_sockaddr_t* server, const isc_sockaddr_t* local, const struct perf_net_xdpconf* conf,
+    const char** reason)
+{
+    *reason = "not built with AF_XDP support";
+    return NULL;
+}
+
+void perf_net_xdp_destroy(struct perf_net_xdp* xdp)
+{
+}
+
+int perf_net_xdp_recv(struct perf_net_xdp* xdp, struct perf_net_packet* pkts, unsigned int* which, unsigned int npkts)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void perf_net_xdp_wait(struct perf_net_xdp* xdp, int64_t timeout)
+{
+}
+
+#endif
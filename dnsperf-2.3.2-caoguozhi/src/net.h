@@ -24,6 +24,7 @@
 #include <sys/socket.h>
 #include <openssl/ssl.h>
 #include <pthread.h>
+#include <stdbool.h>
 
 enum perf_net_mode {
     sock_none,
@@ -34,9 +35,13 @@ enum perf_net_mode {
     sock_tls
 };
 
+struct perf_net_uring;
+struct perf_net_gro;
+struct perf_net_xdp;
+
 struct perf_net_socket {
     enum perf_net_mode      mode;
-    int                     fd, have_more, is_ready, flags, is_ssl_ready;
+    int                     fd, have_more, is_ready, flags, is_ssl_ready, timestamps, gso;
     char*                   recvbuf;
     size_t                  at, sending;
     char*                   sendbuf;
@@ -44,11 +49,50 @@ struct perf_net_socket {
     socklen_t               addrlen;
     SSL*                    ssl;
     pthread_mutex_t         lock;
+    struct perf_net_uring*  uring; /* set when the socket is driven by io_uring */
+    unsigned int            uring_index;
+    int                     uring_busy;
+    struct perf_net_gro*    gro; /* set when UDP GRO is enabled */
+    struct perf_net_xdp*    xdp; /* set when the socket's traffic goes through AF_XDP */
+    unsigned int            xdp_index;
+};
+
+/*
+ * Transport flags returned by perf_net_parsetransport().
+ */
+#define PERF_NET_URING 0x1 /* use the io_uring engine */
+#define PERF_NET_URING_SQPOLL 0x2 /* let a kernel thread poll the submission queue */
+#define PERF_NET_GSO 0x4 /* send runs of equal-size UDP packets as one GSO buffer */
+#define PERF_NET_XDP 0x8 /* use the AF_XDP engine */
+
+/*
+ * AF_XDP engine settings.  Each thread binds its own queue, queue plus
+ * the thread number.
+ */
+struct perf_net_xdpconf {
+    const char*  ifname;
+    unsigned int queue;
+    bool         native; /* driver mode XDP, zero-copy if the driver can */
+    const char*  dmac; /* next hop MAC, NULL to look up the server */
+};
+
+/*
+ * Maximum number of packets moved by a single batched receive or send.
+ */
+#define PERF_NET_MAX_BATCH 256
+
+struct perf_net_packet {
+    unsigned char* buf;
+    size_t         len; /* buffer size on input, bytes received on output */
+    uint64_t       rx_time; /* kernel receive time on perf_os_clock, 0 if unknown */
 };
 
 ssize_t perf_net_recv(struct perf_net_socket* sock, void* buf, size_t len, int flags);
+int perf_net_recvmmsg(struct perf_net_socket* sock, struct perf_net_packet* pkts, unsigned int npkts, int flags);
 ssize_t perf_net_sendto(struct perf_net_socket* sock, const void* buf, size_t len, int flags,
     const struct sockaddr* dest_addr, socklen_t addrlen);
+int perf_net_sendmmsg(struct perf_net_socket* sock, const struct perf_net_packet* pkts, unsigned int npkts, int flags,
+    const struct sockaddr* dest_addr, socklen_t addrlen);
 int perf_net_close(struct perf_net_socket* sock);
 int perf_net_sockeq(struct perf_net_socket* sock_a, struct perf_net_socket* sock_b);
 
@@ -60,11 +104,54 @@ void perf_net_parseserver(int family, const char* name, unsigned int port,
 void perf_net_parselocal(int family, const char* name, unsigned int port,
     isc_sockaddr_t* addr);
 
+/*
+ * Parse a comma separated list of local addresses and CIDR blocks into
+ * a new array, returned in *addrs.  Returns the number of addresses.
+ */
+#define PERF_NET_MAX_LOCAL_ADDRS 65536
+
+unsigned int perf_net_parselocals(int family, const char* spec, unsigned int port,
+    isc_sockaddr_t** addrs);
+
 struct perf_net_socket perf_net_opensocket(enum perf_net_mode mode, const isc_sockaddr_t* server, const isc_sockaddr_t* local,
     unsigned int offset, int bufsize);
 
+/*
+ * Open a socket from a source port range: UDP sockets are bound to port,
+ * TCP and TLS sockets let connect() pick a free port from first to last
+ * where the kernel can (IP_LOCAL_PORT_RANGE), and bind to port otherwise.
+ * A last of 0 means no range.  freebind sets IP_FREEBIND, so the local
+ * address need not be configured on the host.
+ */
+struct perf_net_socket perf_net_opensocket_range(enum perf_net_mode mode, const isc_sockaddr_t* server,
+    const isc_sockaddr_t* local, unsigned int port, unsigned int first, unsigned int last, int bufsize,
+    bool freebind);
+
 enum perf_net_mode perf_net_parsemode(const char* mode);
+enum perf_net_mode perf_net_parsetransport(const char* transport, unsigned int* flags);
 
 int perf_net_sockready(struct perf_net_socket* sock, int pipe_fd, int64_t timeout);
+int perf_net_rxtimestamps(struct perf_net_socket* sock);
+int perf_net_gso(struct perf_net_socket* sock);
+int perf_net_gro(struct perf_net_socket* sock);
+int perf_net_busypoll(struct perf_net_socket* sock, unsigned int usec);
+int perf_net_trackcpu(struct perf_net_socket* sock, const isc_sockaddr_t* server);
+int perf_net_incomingcpu(const struct perf_net_socket* sock);
+
+struct perf_net_uring* perf_net_uring_create(struct perf_net_socket* socks, unsigned int nsocks,
+    const isc_sockaddr_t* server, unsigned int flags, const char** reason);
+void perf_net_uring_destroy(struct perf_net_uring* ring);
+int perf_net_uring_recv(struct perf_net_uring* ring, struct perf_net_packet* pkts, unsigned int* which, unsigned int npkts);
+void perf_net_uring_wait(struct perf_net_uring* ring, int64_t timeout);
+unsigned int perf_net_uring_sendroom(struct perf_net_uring* ring, unsigned int npkts);
+void perf_net_uring_sendwait(struct perf_net_uring* ring, int64_t timeout);
+uint64_t perf_net_uring_truncated(const struct perf_net_uring* ring);
+
+struct perf_net_xdp* perf_net_xdp_create(struct perf_net_socket* socks, unsigned int nsocks,
+    const isc_sockaddr_t* server, const isc_sockaddr_t* local, const struct perf_net_xdpconf* conf,
+    const char** reason);
+void perf_net_xdp_destroy(struct perf_net_xdp* xdp);
+int perf_net_xdp_recv(struct perf_net_xdp* xdp, struct perf_net_packet* pkts, unsigned int* which, unsigned int npkts);
+void perf_net_xdp_wait(struct perf_net_xdp* xdp, int64_t timeout);
 
 #endif
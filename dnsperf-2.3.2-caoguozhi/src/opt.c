@@ -35,10 +35,12 @@
 #include "util.h"
 
 #define MAX_OPTS 64
+#define MAX_LONG_OPTS 64
 #define LINE_LENGTH 80
 
 typedef struct {
     char           c;
+    const char*    name;
     perf_opttype_t type;
     const char*    desc;
     const char*    help;
@@ -57,6 +59,8 @@ typedef struct {
 
 static opt_t        opts[MAX_OPTS];
 static unsigned int nopts;
+static opt_t        long_opts[MAX_LONG_OPTS];
+static unsigned int nlong_opts;
 static char         optstr[MAX_OPTS * 2 + 2];
 static const char*  progname;
 
@@ -89,6 +93,28 @@ void perf_opt_add(char c, perf_opttype_t type, const char* desc, const char* hel
 #endif
 }
 
+void perf_long_opt_add(const char* name, perf_opttype_t type, const char* desc, const char* help,
+    const char* defval, void* valp)
+{
+    opt_t* opt;
+
+    if (nlong_opts == MAX_LONG_OPTS)
+        perf_log_fatal("too many defined long options");
+    opt       = &long_opts[nlong_opts++];
+    opt->c    = 'O';
+    opt->name = name;
+    opt->type = type;
+    opt->desc = desc;
+    opt->help = help;
+    if (defval != NULL) {
+        strncpy(opt->defvalbuf, defval, sizeof(opt->defvalbuf));
+        opt->defval = opt->defvalbuf;
+    } else {
+        opt->defval = NULL;
+    }
+    opt->u.valp = valp;
+}
+
 void perf_opt_usage(void)
 {
     unsigned int prefix_len, position, arg_len, i, j;
@@ -119,6 +145,19 @@ void perf_opt_usage(void)
             fprintf(stderr, " (default: %s)", opts[i].defval);
         fprintf(stderr, "\n");
     }
+
+    if (nlong_opts > 0)
+        fprintf(stderr, "\nExtended options (-O name[=value]):\n");
+    for (i = 0; i < nlong_opts; i++) {
+        if (long_opts[i].type == perf_opt_boolean)
+            fprintf(stderr, "  %s", long_opts[i].name);
+        else
+            fprintf(stderr, "  %s=<%s>", long_opts[i].name, long_opts[i].desc);
+        fprintf(stderr, " %s", long_opts[i].help);
+        if (long_opts[i].defval)
+            fprintf(stderr, " (default: %s)", long_opts[i].defval);
+        fprintf(stderr, "\n");
+    }
 }
 
 static uint32_t
@@ -171,6 +210,60 @@ parse_timeval(const char* desc, const char* str)
     return MILLION * parse_double(desc, str);
 }
 
+static void
+parse_value(opt_t* opt, const char* arg)
+{
+    switch (opt->type) {
+    case perf_opt_string:
+        *opt->u.stringp = (char*)arg;
+        break;
+    case perf_opt_boolean:
+        *opt->u.boolp = true;
+        break;
+    case perf_opt_uint:
+        *opt->u.uintp = parse_uint(opt->desc, arg,
+            1, 0xFFFFFFFF);
+        break;
+    case perf_opt_timeval:
+        *opt->u.uint64p = parse_timeval(opt->desc, arg);
+        break;
+    case perf_opt_double:
+        *opt->u.doublep = parse_double(opt->desc, arg);
+        break;
+    case perf_opt_port:
+        *opt->u.portp = parse_uint(opt->desc, arg,
+            0, 0xFFFF);
+        break;
+    }
+}
+
+static void
+parse_long_opt(char* arg)
+{
+    char*        value;
+    unsigned int i;
+
+    value = strchr(arg, '=');
+    if (value != NULL)
+        *value++ = 0;
+
+    for (i = 0; i < nlong_opts; i++) {
+        if (!strcmp(long_opts[i].name, arg))
+            break;
+    }
+    if (i == nlong_opts) {
+        fprintf(stderr, "invalid long option: %s\n", arg);
+        perf_opt_usage();
+        exit(1);
+    }
+    if (long_opts[i].type != perf_opt_boolean && value == NULL) {
+        fprintf(stderr, "long option %s requires a value\n", arg);
+        perf_opt_usage();
+        exit(1);
+    }
+    parse_value(&long_opts[i], value);
+}
+
 void perf_opt_parse(int argc, char** argv)
 {
     int          c;
@@ -179,6 +272,8 @@ void perf_opt_parse(int argc, char** argv)
 
     progname = isc_file_basename(argv[0]);
 
+    if (nlong_opts > 0)
+        perf_opt_add('O', perf_opt_string, "name=value", "set extended long option", NULL, NULL);
     perf_opt_add('h', perf_opt_boolean, NULL, "print this help", NULL, NULL);
 
     while ((c = getopt(argc, argv, optstr)) != -1) {
@@ -194,29 +289,12 @@ void perf_opt_parse(int argc, char** argv)
             perf_opt_usage();
             exit(0);
         }
-        opt = &opts[i];
-        switch (opt->type) {
-        case perf_opt_string:
-            *opt->u.stringp = optarg;
-            break;
-        case perf_opt_boolean:
-            *opt->u.boolp = true;
-            break;
-        case perf_opt_uint:
-            *opt->u.uintp = parse_uint(opt->desc, optarg,
-                1, 0xFFFFFFFF);
-            break;
-        case perf_opt_timeval:
-            *opt->u.uint64p = parse_timeval(opt->desc, optarg);
-            break;
-        case perf_opt_double:
-            *opt->u.doublep = parse_double(opt->desc, optarg);
-            break;
-        case perf_opt_port:
-            *opt->u.portp = parse_uint(opt->desc, optarg,
-                0, 0xFFFF);
-            break;
+        if (c == 'O' && nlong_opts > 0) {
+            parse_long_opt(optarg);
+            continue;
         }
+        opt = &opts[i];
+        parse_value(opt, optarg);
     }
     if (optind != argc) {
         fprintf(stderr, "unexpected argument %s\n", argv[optind]);
@@ -32,6 +32,9 @@ typedef enum {
 void perf_opt_add(char c, perf_opttype_t type, const char* desc, const char* help,
     const char* defval, void* valp);
 
+void perf_long_opt_add(const char* name, perf_opttype_t type, const char* desc, const char* help,
+    const char* defval, void* valp);
+
 void perf_opt_usage(void);
 
 void perf_opt_parse(int argc, char** argv);
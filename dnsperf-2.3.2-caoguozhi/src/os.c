@@ -17,14 +17,36 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
-#include <sys/select.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <glob.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 #include <isc/result.h>
 #include <isc/types.h>
@@ -63,89 +85,612 @@ perf_os_waituntilreadable(struct perf_net_socket* sock, int pipe_fd, int64_t tim
     return perf_os_waituntilanyreadable(sock, 1, pipe_fd, timeout);
 }
 
-isc_result_t
-perf_os_waituntilanyreadable(struct perf_net_socket* socks, unsigned int nfds, int pipe_fd,
-    int64_t timeout)
+static isc_result_t
+waituntilany(struct perf_net_socket* socks, unsigned int nfds, int pipe_fd,
+    int64_t timeout, short events)
 {
-    fd_set         read_fds;
-    unsigned int   i;
-    int            maxfd;
-    struct timeval tv, *tvp;
-    int            n;
+    struct pollfd    fixed[16], *pfds;
+    unsigned int     i;
+    struct timespec  ts, *tsp;
+    int              n;
+    isc_result_t     result;
 
-    FD_ZERO(&read_fds);
-    maxfd = 0;
+    pfds = fixed;
+    if (nfds + 1 > sizeof(fixed) / sizeof(fixed[0])) {
+        pfds = calloc(nfds + 1, sizeof(*pfds));
+        if (pfds == NULL)
+            perf_log_fatal("out of memory");
+    }
     for (i = 0; i < nfds; i++) {
-        if (socks[i].have_more)
-            return (ISC_R_SUCCESS);
-        FD_SET(socks[i].fd, &read_fds);
-        if (socks[i].fd > maxfd)
-            maxfd = socks[i].fd;
+        pfds[i].fd      = socks[i].fd;
+        pfds[i].events  = events;
+        pfds[i].revents = 0;
     }
-    FD_SET(pipe_fd, &read_fds);
-    if (pipe_fd > maxfd)
-        maxfd = pipe_fd;
+    pfds[nfds].fd      = pipe_fd;
+    pfds[nfds].events  = POLLIN;
+    pfds[nfds].revents = 0;
 
     if (timeout < 0) {
-        tvp = NULL;
+        tsp = NULL;
     } else {
-        tv.tv_sec  = timeout / MILLION;
-        tv.tv_usec = timeout % MILLION;
-        tvp        = &tv;
+        ts.tv_sec  = timeout / MILLION;
+        ts.tv_nsec = (timeout % MILLION) * 1000;
+        tsp        = &ts;
     }
-    n = select(maxfd + 1, &read_fds, NULL, NULL, tvp);
+    n = ppoll(pfds, nfds + 1, tsp, NULL);
     if (n < 0) {
         if (errno != EINTR)
-            perf_log_fatal("select(): %s", strerror(errno));
-        return (ISC_R_CANCELED);
+            perf_log_fatal("poll(): %s", strerror(errno));
+        result = ISC_R_CANCELED;
     } else if (n == 0) {
-        return (ISC_R_TIMEDOUT);
-    } else if (FD_ISSET(pipe_fd, &read_fds)) {
-        return (ISC_R_CANCELED);
+        result = ISC_R_TIMEDOUT;
+    } else if (pfds[nfds].revents != 0) {
+        result = ISC_R_CANCELED;
     } else {
-        return (ISC_R_SUCCESS);
+        result = ISC_R_SUCCESS;
     }
+
+    if (pfds != fixed)
+        free(pfds);
+    return (result);
 }
 
 isc_result_t
-perf_os_waituntilanywritable(struct perf_net_socket* socks, unsigned int nfds, int pipe_fd,
+perf_os_waituntilanyreadable(struct perf_net_socket* socks, unsigned int nfds, int pipe_fd,
     int64_t timeout)
 {
-    fd_set         write_fds, read_fds;
-    unsigned int   i;
-    int            maxfd;
-    struct timeval tv, *tvp;
-    int            n;
+    unsigned int i;
 
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-    maxfd = 0;
     for (i = 0; i < nfds; i++) {
-        FD_SET(socks[i].fd, &write_fds);
-        if (socks[i].fd > maxfd)
-            maxfd = socks[i].fd;
+        if (socks[i].have_more)
+            return (ISC_R_SUCCESS);
     }
-    FD_SET(pipe_fd, &read_fds);
-    if (pipe_fd > maxfd)
-        maxfd = pipe_fd;
+    return waituntilany(socks, nfds, pipe_fd, timeout, POLLIN);
+}
 
-    if (timeout < 0) {
-        tvp = NULL;
-    } else {
-        tv.tv_sec  = timeout / MILLION;
-        tv.tv_usec = timeout % MILLION;
-        tvp        = &tv;
+isc_result_t
+perf_os_waituntilanywritable(struct perf_net_socket* socks, unsigned int nfds, int pipe_fd,
+    int64_t timeout)
+{
+    return waituntilany(socks, nfds, pipe_fd, timeout, POLLOUT);
+}
+
+void perf_os_poller_init(struct perf_os_poller* poller, struct perf_net_socket* socks,
+    unsigned int nsocks, int pipe_fd)
+{
+    unsigned int i;
+#ifdef __linux__
+    struct epoll_event ev;
+#endif
+
+    memset(poller, 0, sizeof(*poller));
+    poller->socks   = socks;
+    poller->nsocks  = nsocks;
+    poller->pipe_fd = pipe_fd;
+    poller->epfd    = -1;
+    poller->ready   = calloc(nsocks, sizeof(*poller->ready));
+    poller->queued  = calloc(nsocks, sizeof(*poller->queued));
+    if (poller->ready == NULL || poller->queued == NULL)
+        perf_log_fatal("out of memory");
+
+#ifdef __linux__
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd < 0)
+        perf_log_fatal("epoll_create1(): %s", strerror(errno));
+    poller->events = calloc(nsocks + 1, sizeof(struct epoll_event));
+    if (poller->events == NULL)
+        perf_log_fatal("out of memory");
+
+    /*
+     * Datagram sockets are always read until EAGAIN or a short batch
+     * before they are marked idle, so they can be edge-triggered.  Stream
+     * sockets buffer partial messages in user space and stay
+     * level-triggered.
+     */
+    for (i = 0; i < nsocks; i++) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        if (socks[i].mode == sock_udp)
+            ev.events |= EPOLLET;
+        ev.data.u32 = i;
+        if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, socks[i].fd, &ev) < 0)
+            perf_log_fatal("epoll_ctl(): %s", strerror(errno));
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.u32 = nsocks;
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, pipe_fd, &ev) < 0)
+        perf_log_fatal("epoll_ctl(): %s", strerror(errno));
+#else
+    poller->events = calloc(nsocks + 1, sizeof(struct pollfd));
+    if (poller->events == NULL)
+        perf_log_fatal("out of memory");
+#endif
+
+    /* Start with every socket on the ready list; reading is cheap. */
+    for (i = 0; i < nsocks; i++) {
+        poller->ready[i]  = i;
+        poller->queued[i] = true;
+    }
+    poller->nready = nsocks;
+}
+
+void perf_os_poller_cleanup(struct perf_os_poller* poller)
+{
+    if (poller->epfd >= 0)
+        close(poller->epfd);
+    free(poller->events);
+    free(poller->queued);
+    free(poller->ready);
+    memset(poller, 0, sizeof(*poller));
+    poller->epfd = -1;
+}
+
+static inline void
+poller_queue(struct perf_os_poller* poller, unsigned int which)
+{
+    if (!poller->queued[which]) {
+        poller->queued[which]            = true;
+        poller->ready[poller->nready++] = which;
+    }
+}
+
+/*
+ * Drop sockets marked idle from the ready list, keeping the order of the
+ * rest.
+ */
+static void
+poller_compact(struct perf_os_poller* poller)
+{
+    unsigned int i, n;
+
+    for (i = 0, n = 0; i < poller->nready; i++) {
+        if (poller->queued[poller->ready[i]])
+            poller->ready[n++] = poller->ready[i];
     }
-    n = select(maxfd + 1, &read_fds, &write_fds, NULL, tvp);
+    poller->nready = n;
+}
+
+/*
+ * Wait for any of the sockets to become readable and add them to the
+ * ready list.  Returns ISC_R_CANCELED if the pipe became readable.
+ */
+isc_result_t
+perf_os_poller_wait(struct perf_os_poller* poller, int64_t timeout)
+{
+    bool canceled = false;
+    int  n, ms;
+#ifdef __linux__
+    struct epoll_event* events = poller->events;
+    int                 i;
+
+    poller_compact(poller);
+
+    ms = timeout < 0 ? -1 : (int)((timeout + 999) / 1000);
+    n  = epoll_wait(poller->epfd, events, poller->nsocks + 1, ms);
     if (n < 0) {
         if (errno != EINTR)
-            perf_log_fatal("select(): %s", strerror(errno));
+            perf_log_fatal("epoll_wait(): %s", strerror(errno));
         return (ISC_R_CANCELED);
-    } else if (n == 0) {
-        return (ISC_R_TIMEDOUT);
-    } else if (FD_ISSET(pipe_fd, &read_fds)) {
+    }
+    for (i = 0; i < n; i++) {
+        if (events[i].data.u32 == poller->nsocks)
+            canceled = true;
+        else
+            poller_queue(poller, events[i].data.u32);
+    }
+#else
+    struct pollfd* pfds = poller->events;
+    unsigned int   j;
+
+    poller_compact(poller);
+
+    for (j = 0; j < poller->nsocks; j++) {
+        pfds[j].fd      = poller->socks[j].fd;
+        pfds[j].events  = POLLIN;
+        pfds[j].revents = 0;
+    }
+    pfds[j].fd      = poller->pipe_fd;
+    pfds[j].events  = POLLIN;
+    pfds[j].revents = 0;
+
+    ms = timeout < 0 ? -1 : (int)((timeout + 999) / 1000);
+    n  = poll(pfds, poller->nsocks + 1, ms);
+    if (n < 0) {
+        if (errno != EINTR)
+            perf_log_fatal("poll(): %s", strerror(errno));
         return (ISC_R_CANCELED);
-    } else {
-        return (ISC_R_SUCCESS);
     }
+    for (j = 0; j < poller->nsocks; j++) {
+        if (pfds[j].revents != 0)
+            poller_queue(poller, j);
+    }
+    canceled = pfds[poller->nsocks].revents != 0;
+#endif
+
+    if (canceled)
+        return (ISC_R_CANCELED);
+    return (n == 0 ? ISC_R_TIMEDOUT : ISC_R_SUCCESS);
+}
+
+void perf_os_poller_idle(struct perf_os_poller* poller, unsigned int which)
+{
+    poller->queued[which] = false;
+}
+
+struct perf_os_clock perf_os_clock;
+
+static uint64_t clock_wall_base, clock_mono_base;
+
+enum perf_os_clocksource perf_os_clock_parse(const char* name)
+{
+    if (!strcmp(name, "raw"))
+        return perf_os_clock_raw;
+    if (!strcmp(name, "tsc"))
+        return perf_os_clock_tsc;
+    perf_log_fatal("invalid clock source: %s", name);
+    return perf_os_clock_raw;
+}
+
+static uint64_t clock_read(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+/*
+ * Scale the TSC against CLOCK_MONOTONIC_RAW over a short sleep.  Only an
+ * invariant TSC (constant rate, running in deep C-states) qualifies.
+ */
+static bool clock_calibrate_tsc(void)
+{
+    struct timespec delay = { 0, 50000000 };
+    unsigned int    eax, ebx, ecx, edx;
+    uint64_t        t0, t1, c0, c1;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        return false;
+
+    c0 = __builtin_ia32_rdtsc();
+    t0 = clock_read(CLOCK_MONOTONIC_RAW);
+    nanosleep(&delay, NULL);
+    c1 = __builtin_ia32_rdtsc();
+    t1 = clock_read(CLOCK_MONOTONIC_RAW);
+    if (c1 <= c0 || t1 <= t0)
+        return false;
+
+    perf_os_clock.mult     = ((t1 - t0) << 32) / (c1 - c0);
+    perf_os_clock.tsc_base = c1;
+    perf_os_clock.ns_base  = t1;
+    return perf_os_clock.mult != 0;
+}
+#endif
+
+void perf_os_clock_init(enum perf_os_clocksource source)
+{
+    perf_os_clock.source = perf_os_clock_raw;
+    if (source == perf_os_clock_tsc) {
+#if defined(__x86_64__)
+        if (clock_calibrate_tsc())
+            perf_os_clock.source = perf_os_clock_tsc;
+        else
+#endif
+            perf_log_warning("no invariant TSC, using CLOCK_MONOTONIC_RAW");
+    }
+
+    clock_mono_base = perf_os_clock_now();
+    clock_wall_base = clock_read(CLOCK_REALTIME);
+}
+
+const char* perf_os_clock_name(void)
+{
+    return perf_os_clock.source == perf_os_clock_tsc ? "tsc" : "CLOCK_MONOTONIC_RAW";
+}
+
+/*
+ * Ticks per second of the calibrated TSC, or 0.
+ */
+double perf_os_clock_tschz(void)
+{
+    if (perf_os_clock.source != perf_os_clock_tsc)
+        return 0;
+    return (double)BILLION * 4294967296.0 / perf_os_clock.mult;
+}
+
+/*
+ * Wall-clock nanoseconds since the epoch for a clock reading, for log
+ * lines only: the offset is fixed when the clock is initialized.
+ */
+uint64_t perf_os_clock_towall(uint64_t when)
+{
+    return clock_wall_base + (when - clock_mono_base);
+}
+
+/*
+ * Absolute CLOCK_MONOTONIC time for a clock reading, for perf_os_wait()
+ * and perf_os_sleepuntil().  Readings past the representable range map
+ * to the far future.
+ */
+void perf_os_clock_totimespec(uint64_t when, struct timespec* ts)
+{
+    uint64_t now, mono;
+
+    now  = perf_os_clock_now();
+    mono = clock_read(CLOCK_MONOTONIC);
+    if (when > now && when - now > (uint64_t)INT32_MAX * BILLION) {
+        ts->tv_sec  = INT32_MAX;
+        ts->tv_nsec = 0;
+        return;
+    }
+    mono += when > now ? when - now : 0;
+    ts->tv_sec  = mono / BILLION;
+    ts->tv_nsec = mono % BILLION;
+}
+
+void perf_os_pace_init(void)
+{
+#ifdef __linux__
+    (void)prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+#endif
+}
+
+void perf_os_sleepuntil(uint64_t when)
+{
+    struct timespec ts;
+
+    if (when > perf_os_clock_now() + PERF_OS_SPIN_NS) {
+        perf_os_clock_totimespec(when - PERF_OS_SPIN_NS, &ts);
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            return;
+    }
+    while (perf_os_clock_now() < when) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+int perf_os_pinthread(pthread_t thread, unsigned int index)
+{
+#ifdef __linux__
+    cpu_set_t allowed, set;
+    int       cpu, n;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -1;
+    n = CPU_COUNT(&allowed);
+    if (n == 0)
+        return -1;
+    index %= n;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0)
+            break;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+        return -1;
+    return cpu;
+#else
+    (void)thread;
+    (void)index;
+    return -1;
+#endif
+}
+
+int perf_os_parsecpus(const char* list, int* cpus, int max)
+{
+    const char* p = list;
+    char*       end;
+    long        first, last;
+    int         n = 0;
+
+    while (*p != 0) {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            p    = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (*end != ',' && *end != 0)
+            return -1;
+        for (; first <= last && n < max; first++)
+            cpus[n++] = first;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+#ifdef __linux__
+/*
+ * Add the CPUs of a sysfs CPU mask ("ff,00000000", most significant
+ * 32 bits first) to set.
+ */
+static void
+cpumask_add(const char* mask, cpu_set_t* set)
+{
+    int         len, bit, d;
+    const char* p;
+
+    len = strlen(mask);
+    bit = 0;
+    for (p = mask + len - 1; p >= mask; p--) {
+        if (*p == ',' || *p == '\n')
+            continue;
+        d = *p >= '0' && *p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10;
+        if (d < 0 || d > 15)
+            continue;
+        for (int i = 0; i < 4; i++) {
+            if ((d & (1 << i)) && bit + i < CPU_SETSIZE)
+                CPU_SET(bit + i, set);
+        }
+        bit += 4;
+    }
+}
+#endif
+
+int perf_os_autocpus(int* cpus, int max)
+{
+#ifdef __linux__
+    cpu_set_t allowed, rps, avail;
+    glob_t    g;
+    char      mask[1024];
+    FILE*     f;
+    size_t    i;
+    int       cpu, node, best, n, count[64];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return 0;
+
+    CPU_ZERO(&rps);
+    if (glob("/sys/class/net/*/queues/rx-*/rps_cpus", 0, NULL, &g) == 0) {
+        for (i = 0; i < g.gl_pathc; i++) {
+            if ((f = fopen(g.gl_pathv[i], "r")) == NULL)
+                continue;
+            if (fgets(mask, sizeof(mask), f))
+                cpumask_add(mask, &rps);
+            fclose(f);
+        }
+        globfree(&g);
+    }
+    CPU_XOR(&avail, &allowed, &rps);
+    CPU_AND(&avail, &avail, &allowed);
+    if (CPU_COUNT(&avail) == 0)
+        avail = allowed;
+
+    memset(count, 0, sizeof(count));
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &avail) && (node = perf_os_cpunode(cpu)) >= 0 && node < 64)
+            count[node]++;
+    }
+    for (best = -1, node = 0; node < 64; node++) {
+        if (count[node] > 0 && (best < 0 || count[node] > count[best]))
+            best = node;
+    }
+
+    n = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &avail) && (best < 0 || perf_os_cpunode(cpu) == best))
+            cpus[n++] = cpu;
+    }
+    return n;
+#else
+    (void)cpus;
+    (void)max;
+    return 0;
+#endif
+}
+
+int perf_os_pincpu(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+        return -1;
+    return cpu;
+#else
+    (void)thread;
+    (void)cpu;
+    return -1;
+#endif
+}
+
+int perf_os_cpunode(int cpu)
+{
+#ifdef __linux__
+    char           path[64];
+    DIR*           dir;
+    struct dirent* de;
+    int            node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL)
+        return -1;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+void perf_os_bindnode(void* addr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    uintptr_t     page, start, end;
+
+    if (node < 0 || node >= 1024)
+        return;
+    page  = sysconf(_SC_PAGESIZE);
+    start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    end   = ((uintptr_t)addr + len) & ~(page - 1);
+    if (end <= start)
+        return;
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask, 1024, MPOL_MF_MOVE);
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+#endif
+}
+
+unsigned int perf_os_fdlimit(unsigned int nfds)
+{
+    struct rlimit rl;
+    rlim_t        want = nfds;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return 0;
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want) {
+        rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > want ? want : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > UINT_MAX)
+        return UINT_MAX;
+    return rl.rlim_cur;
+}
+
+void perf_os_wait(uint32_t* addr, uint32_t val, const struct timespec* abstime)
+{
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val,
+        abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+#else
+    struct timespec ts = { 0, 50000 };
+
+    (void)abstime;
+    if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+        nanosleep(&ts, NULL);
+#endif
+}
+
+void perf_os_wake(uint32_t* addr)
+{
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT32_MAX, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
 }
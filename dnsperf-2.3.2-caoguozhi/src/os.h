@@ -23,7 +23,9 @@
 #define PERF_OS_H 1
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 
 void perf_os_blocksignal(int sig, bool block);
 
@@ -40,4 +42,153 @@ isc_result_t
 perf_os_waituntilanywritable(struct perf_net_socket* socks, unsigned int nfds, int pipe_fd,
     int64_t timeout);
 
+/*
+ * Persistent readiness tracking for a fixed set of sockets.  The sockets
+ * are registered once (with epoll where available) and the poller keeps
+ * a list of sockets that may have data, so that callers only read from
+ * those.  A socket stays on the list until the caller reports it drained
+ * with perf_os_poller_idle(); the list is compacted on the next wait.
+ */
+struct perf_os_poller {
+    struct perf_net_socket* socks;
+    unsigned int            nsocks;
+    int                     pipe_fd;
+    int                     epfd;
+    void*                   events;
+    unsigned int*           ready;
+    unsigned int            nready;
+    bool*                   queued;
+};
+
+void perf_os_poller_init(struct perf_os_poller* poller, struct perf_net_socket* socks,
+    unsigned int nsocks, int pipe_fd);
+
+void perf_os_poller_cleanup(struct perf_os_poller* poller);
+
+isc_result_t
+perf_os_poller_wait(struct perf_os_poller* poller, int64_t timeout);
+
+void perf_os_poller_idle(struct perf_os_poller* poller, unsigned int which);
+
+/*
+ * Pin a thread to the index'th CPU the process may run on, wrapping
+ * around.  Returns the CPU, or -1 if the thread could not be pinned.
+ */
+int perf_os_pinthread(pthread_t thread, unsigned int index);
+
+/*
+ * CPU placement.  perf_os_parsecpus() reads a list such as "2-5,8" and
+ * perf_os_autocpus() picks the CPUs the process may run on that no
+ * network device steers packets to with RPS, all on the NUMA node with
+ * the most of them.  Both fill in at most max CPUs and return how many,
+ * or -1 on a malformed list.
+ */
+#define PERF_OS_MAX_CPUS 1024
+
+int perf_os_parsecpus(const char* list, int* cpus, int max);
+
+int perf_os_autocpus(int* cpus, int max);
+
+/*
+ * Pin a thread to one CPU.  Returns the CPU, or -1 if it could not be
+ * pinned.
+ */
+int perf_os_pincpu(pthread_t thread, int cpu);
+
+/*
+ * The NUMA node of a CPU, or -1 if unknown.
+ */
+int perf_os_cpunode(int cpu);
+
+/*
+ * Prefer node for the whole pages of [addr, addr + len), moving those
+ * already in use.  Best effort: failures are ignored.
+ */
+void perf_os_bindnode(void* addr, size_t len, int node);
+
+/*
+ * Raise the soft limit on open files to nfds, up to the hard limit.
+ * Returns the number the process may have open.
+ */
+unsigned int perf_os_fdlimit(unsigned int nfds);
+
+/*
+ * Sleep and wake-up on a 32-bit word shared between two threads, a futex
+ * on Linux.  perf_os_wait() returns once *addr no longer holds val, on
+ * perf_os_wake(), or at the absolute CLOCK_MONOTONIC time abstime (NULL
+ * waits forever), and may return spuriously.  Wakers change the word
+ * before calling perf_os_wake(), so a wake-up can never be lost.
+ */
+void perf_os_wait(uint32_t* addr, uint32_t val, const struct timespec* abstime);
+
+void perf_os_wake(uint32_t* addr);
+
+/*
+ * Clock for all internal timestamps, in nanoseconds.  It reads
+ * CLOCK_MONOTONIC_RAW, or with the TSC source the time stamp counter
+ * scaled by a factor calibrated against it, so NTP adjustments never
+ * show up in measurements.  perf_os_clock_init() must be called before
+ * any thread reads the clock; it falls back to CLOCK_MONOTONIC_RAW if
+ * the TSC is not invariant.
+ */
+enum perf_os_clocksource {
+    perf_os_clock_raw,
+    perf_os_clock_tsc
+};
+
+struct perf_os_clock {
+    enum perf_os_clocksource source;
+    uint64_t                 tsc_base;
+    uint64_t                 ns_base;
+    uint64_t                 mult; /* nanoseconds per tick, 32.32 fixed point */
+};
+
+extern struct perf_os_clock perf_os_clock;
+
+enum perf_os_clocksource perf_os_clock_parse(const char* name);
+
+void perf_os_clock_init(enum perf_os_clocksource source);
+
+const char* perf_os_clock_name(void);
+
+double perf_os_clock_tschz(void);
+
+uint64_t perf_os_clock_towall(uint64_t when);
+
+void perf_os_clock_totimespec(uint64_t when, struct timespec* ts);
+
+static __inline__ uint64_t
+perf_os_clock_now(void)
+{
+    struct timespec ts;
+
+#if defined(__x86_64__)
+    if (perf_os_clock.source == perf_os_clock_tsc) {
+        uint64_t ticks = __builtin_ia32_rdtsc() - perf_os_clock.tsc_base;
+        return perf_os_clock.ns_base + (uint64_t)(((unsigned __int128)ticks * perf_os_clock.mult) >> 32);
+    }
+#endif
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Pacing.  perf_os_sleepuntil() returns at the clock reading when, or
+ * as soon as it can after it: it sleeps in the kernel until
+ * PERF_OS_SPIN_NS before and spins on the clock for the rest, which
+ * keeps it within a few microseconds of when, where a plain sleep is
+ * late by the timer slack and the wake-up latency.  A signal cuts the
+ * sleep short.  perf_os_pace_init() brings the calling thread's timer
+ * slack down to its minimum.
+ */
+#define PERF_OS_SPIN_NS 60000
+
+void perf_os_pace_init(void);
+
+void perf_os_sleepuntil(uint64_t when);
+
 #endif
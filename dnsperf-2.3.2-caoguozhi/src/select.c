@@ -0,0 +1,209 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "select.h"
+
+#define SELECT_BUCKETS (1U << PERF_SELECT_BITS)
+
+/* Slices smaller than this are not worth a thread of their own. */
+#define SELECT_MIN_SLICE (1U << 16)
+
+struct select_job {
+    const struct perf_select_span* spans;
+    unsigned int                   nspans;
+    uint64_t                       begin, end;
+    unsigned int                   shift;
+    const uint64_t*                targets;
+    unsigned int                   ntargets;
+    uint64_t*                      counts;
+};
+
+static int find_target(const uint64_t* targets, unsigned int ntargets, uint64_t prefix)
+{
+    unsigned int lo, hi, mid;
+
+    lo = 0;
+    hi = ntargets;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (targets[mid] == prefix)
+            return mid;
+        if (targets[mid] < prefix)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+/*
+ * Counts the digit at job->shift of the samples in [begin, end) whose
+ * higher digits match one of the targets, one row of counts per target.
+ */
+static void* count_slice(void* arg)
+{
+    struct select_job* job = arg;
+    const uint64_t*    values;
+    uint64_t           pos, i, last, value, prefix;
+    unsigned int       s, hishift;
+    int                t;
+
+    hishift = job->shift + PERF_SELECT_BITS;
+    pos     = 0;
+    for (s = 0; s < job->nspans && pos < job->end; pos += job->spans[s].count, s++) {
+        if (pos + job->spans[s].count <= job->begin)
+            continue;
+        values = job->spans[s].values;
+        i      = job->begin > pos ? job->begin - pos : 0;
+        last   = job->end - pos < job->spans[s].count ? job->end - pos : job->spans[s].count;
+        for (; i < last; i++) {
+            value  = values[i];
+            prefix = hishift < 64 ? value >> hishift : 0;
+            if (job->ntargets == 1) {
+                if (prefix != job->targets[0])
+                    continue;
+                t = 0;
+            } else if ((t = find_target(job->targets, job->ntargets, prefix)) < 0) {
+                continue;
+            }
+            job->counts[t * SELECT_BUCKETS + ((value >> job->shift) & (SELECT_BUCKETS - 1))]++;
+        }
+    }
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int perf_select(const struct perf_select_span* spans, unsigned int nspans, uint64_t limit,
+    const uint64_t* ranks, unsigned int nranks, uint64_t* out, unsigned int nworkers)
+{
+    struct select_job* jobs;
+    pthread_t*         threads;
+    bool*              started;
+    uint64_t *         want, *targets, *counts, total, c;
+    unsigned int       ntargets, shift, bits, i, r, w, d;
+    int                t;
+
+    for (total = 0, i = 0; i < nspans; i++)
+        total += spans[i].count;
+    for (r = 0; r < nranks; r++) {
+        if (ranks[r] >= total) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (nranks == 0)
+        return 0;
+    if (nworkers > total / SELECT_MIN_SLICE)
+        nworkers = total / SELECT_MIN_SLICE;
+    if (nworkers == 0)
+        nworkers = 1;
+
+    jobs    = calloc(nworkers, sizeof(*jobs));
+    threads = calloc(nworkers, sizeof(*threads));
+    started = calloc(nworkers, sizeof(*started));
+    want    = calloc(nranks, sizeof(*want));
+    targets = calloc(nranks, sizeof(*targets));
+    counts  = calloc((size_t)nworkers * nranks * SELECT_BUCKETS, sizeof(*counts));
+    if (jobs == NULL || threads == NULL || started == NULL || want == NULL
+        || targets == NULL || counts == NULL) {
+        free(counts);
+        free(targets);
+        free(want);
+        free(started);
+        free(threads);
+        free(jobs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* out[] holds the digits chosen so far, want[] the rank among them. */
+    for (r = 0; r < nranks; r++) {
+        out[r]  = 0;
+        want[r] = ranks[r];
+    }
+    bits  = 64 - __builtin_clzll(limit | 1);
+    shift = (bits - 1) / PERF_SELECT_BITS * PERF_SELECT_BITS;
+
+    for (;;) {
+        memcpy(targets, out, nranks * sizeof(*targets));
+        qsort(targets, nranks, sizeof(*targets), compare_u64);
+        for (ntargets = 1, r = 1; r < nranks; r++) {
+            if (targets[r] != targets[ntargets - 1])
+                targets[ntargets++] = targets[r];
+        }
+
+        memset(counts, 0, (size_t)nworkers * ntargets * SELECT_BUCKETS * sizeof(*counts));
+        for (w = 0; w < nworkers; w++) {
+            jobs[w].spans    = spans;
+            jobs[w].nspans   = nspans;
+            jobs[w].begin    = total / nworkers * w;
+            jobs[w].end      = w == nworkers - 1 ? total : total / nworkers * (w + 1);
+            jobs[w].shift    = shift;
+            jobs[w].targets  = targets;
+            jobs[w].ntargets = ntargets;
+            jobs[w].counts   = counts + (size_t)w * ntargets * SELECT_BUCKETS;
+            started[w]       = w > 0 && pthread_create(&threads[w], NULL, count_slice, &jobs[w]) == 0;
+        }
+        for (w = 0; w < nworkers; w++) {
+            if (!started[w])
+                count_slice(&jobs[w]);
+        }
+        for (w = 1; w < nworkers; w++) {
+            if (started[w])
+                pthread_join(threads[w], NULL);
+            for (i = 0; i < ntargets * SELECT_BUCKETS; i++)
+                counts[i] += jobs[w].counts[i];
+        }
+
+        for (r = 0; r < nranks; r++) {
+            t = find_target(targets, ntargets, out[r]);
+            for (d = 0; d < SELECT_BUCKETS - 1; d++) {
+                c = counts[t * SELECT_BUCKETS + d];
+                if (want[r] < c)
+                    break;
+                want[r] -= c;
+            }
+            out[r] = out[r] << PERF_SELECT_BITS | d;
+        }
+
+        if (shift == 0)
+            break;
+        shift -= PERF_SELECT_BITS;
+    }
+
+    free(counts);
+    free(targets);
+    free(want);
+    free(started);
+    free(threads);
+    free(jobs);
+    return 0;
+}
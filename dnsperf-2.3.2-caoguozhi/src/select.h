@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 OARC, Inc.
+ * Copyright 2017-2018 Akamai Technologies
+ * Copyright 2006-2016 Nominum, Inc.
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PERF_SELECT_H
+#define PERF_SELECT_H 1
+
+#include <inttypes.h>
+
+/*
+ * Exact order statistics of integer samples kept in several arrays,
+ * found without sorting or copying them.  The values are selected by
+ * their radix digits, most significant first: each pass counts, in
+ * parallel over slices of the samples, the next PERF_SELECT_BITS bits
+ * of the values that share the digits already chosen for a wanted
+ * rank, and picks the digit under which that rank falls.  All ranks
+ * are narrowed in the same pass, so the samples are read once per
+ * digit of the largest value, whatever the number of ranks.
+ */
+struct perf_select_span {
+    const uint64_t* values;
+    uint64_t        count;
+};
+
+#define PERF_SELECT_BITS 12
+
+/*
+ * Stores in out[i] the value of rank ranks[i] (0 for the smallest) of
+ * the samples of all spans together, using up to nworkers threads.
+ * No sample may be larger than limit.  Returns -1 with errno set if a
+ * rank is out of range or memory runs out.
+ */
+int perf_select(const struct perf_select_span* spans, unsigned int nspans, uint64_t limit,
+    const uint64_t* ranks, unsigned int nranks, uint64_t* out, unsigned int nworkers);
+
+/*
+ * The rank below which pct percent of count samples fall, as
+ * perf_hist_percentile() takes it.
+ */
+static inline uint64_t
+perf_select_rank(uint64_t count, double pct)
+{
+    uint64_t rank;
+
+    if (count == 0)
+        return 0;
+    rank = (uint64_t)(pct / 100.0 * count);
+    return rank < count ? rank : count - 1;
+}
+
+#endif
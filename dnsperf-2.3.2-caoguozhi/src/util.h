@@ -32,6 +32,7 @@
 #define PERF_UTIL_H 1
 
 #define MILLION ((uint64_t)1000000)
+#define BILLION ((uint64_t)1000000000)
 
 #define THREAD(thread, start, arg)                                      \
     do {                                                                \
@@ -29,13 +29,16 @@
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <arpa/inet.h>
 #include <openssl/ssl.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
@@ -44,7 +47,6 @@
 
 #include <isc/buffer.h>
 #include <isc/file.h>
-#include <isc/list.h>
 #include <isc/mem.h>
 #include <isc/netaddr.h>
 #include <isc/print.h>
@@ -54,14 +56,19 @@
 #include <isc/types.h>
 
 #include <dns/rcode.h>
+#include <dns/rdatatype.h>
 #include <dns/result.h>
 
 #include "net.h"
+#include "arrival.h"
+#include "capture.h"
 #include "datafile.h"
 #include "dns.h"
+#include "hist.h"
 #include "log.h"
 #include "opt.h"
 #include "os.h"
+#include "select.h"
 #include "util.h"
 
 #ifndef ISC_UINT64_MAX
@@ -79,15 +86,43 @@
 
 #define TIMEOUT_CHECK_TIME 100000
 
+/* The run-to-completion engine polls without sleeping for this long
+ * (in microseconds) before a scheduled send, as the poller sleeps in
+ * whole milliseconds. */
+#define RTC_SPIN_TIME 1200
+
+/* With -O open-loop, a query sent later than this after its scheduled
+ * time (in nanoseconds) counts as late. */
+#define LATE_THRESHOLD MILLION
+
+/* Files beyond those fds_needed() counts that may be open at once. */
+#define FD_SLACK 16
+
 #define MAX_INPUT_DATA (64 * 1024)
 
 #define MAX_SOCKETS 256
 
-#define RECV_BATCH_SIZE 16
+#define DEFAULT_RECV_BATCH 16
+#define DEFAULT_SEND_BATCH 1
+#define DEFAULT_GSO_BATCH 64
+#define DEFAULT_PRECISION 3
+/* The -S interval histograms, two per thread, stop at this precision:
+ * a 4-digit histogram takes 4 MB. */
+#define MAX_INTERVAL_PRECISION 3
+#define INTERVAL_PRECISION(config) \
+    ((config)->precision < MAX_INTERVAL_PRECISION ? (config)->precision : MAX_INTERVAL_PRECISION)
+
+#define MAX_QTYPE_TIMEOUTS 16
 
 #define WHITESPACE " \t\n"
 #define NUM_BASE (1000 * 1000) // 存储明细数据100条万为基本单位
 
+typedef struct
+{
+    char qtype[16];
+    uint64_t timeout;
+} qtype_timeout_t;
+
 typedef struct
 {
     int argc;
@@ -95,12 +130,16 @@ typedef struct
     int family;
     char *file_name;
     uint32_t clients;
+    unsigned int port_first, port_last; /* -O port-range, 0 if not set */
     uint32_t threads;
     uint32_t maxruns;
-    uint32_t details;
+    uint32_t details; /* -C, millions of raw samples kept per thread */
+    uint32_t precision;
     uint64_t timelimit;
     isc_sockaddr_t server_addr;
-    isc_sockaddr_t local_addr;
+    isc_sockaddr_t local_addr; /* the first of local_addrs */
+    isc_sockaddr_t *local_addrs;
+    unsigned int nlocal;
     uint64_t timeout;
     uint32_t bufsize;
     bool edns;
@@ -109,10 +148,30 @@ typedef struct
     perf_dnsednsoption_t *edns_option;
     uint32_t max_outstanding;
     uint32_t max_qps;
+    uint32_t recv_batch;
+    uint32_t send_batch;
     uint64_t stats_interval;
     bool updates;
     bool verbose;
+    bool uring_sqpoll;
+    bool kernel_timestamps;
+    bool udp_gro;
+    bool rtc;
+    bool busy_poll;
+    uint32_t busy_poll_usec;
+    int *cpus; /* -O cpus, NULL if threads are left to the scheduler */
+    int ncpus;
+    bool cpus_auto;
+    bool incoming_cpu;
+    bool incoming_steer;
+    bool open_loop;
+    struct perf_arrival_model arrival;
+    struct perf_net_xdpconf xdp;
+    const char *clock;
+    qtype_timeout_t qtype_timeouts[MAX_QTYPE_TIMEOUTS];
+    unsigned int nqtype_timeouts;
     enum perf_net_mode mode;
+    unsigned int net_flags;
 } config_t;
 
 typedef struct
@@ -128,6 +187,9 @@ typedef struct
     uint64_t rcodecounts[16];
 
     uint64_t num_sent;
+    uint64_t num_late;
+    uint64_t num_unsent;
+    bool unsent_estimated;
     uint64_t num_interrupted;
     uint64_t num_timedout;
     uint64_t num_completed;
@@ -136,51 +198,202 @@ typedef struct
     uint64_t total_response_size;
 
     uint64_t latency_sum;
-    uint64_t latency_sum_squares;
+    double latency_sum_squares;
     uint64_t latency_min;
     uint64_t latency_max;
-    float *p_data;     // 装载有效数据
-    uint64_t data_num; // 真实的数据长度
-    float avg_time;    // 平均时延,单位:ms
-    float min_time;    // 最小时延,单位:ms
-    float max_time;    // 最大时延,单位:ms
-    float p95_time;    // P95时延,单位:ms
-    float p99_time;    // P99时延,单位:ms
+    /* Latency to when the receiver read the response, kept only when
+     * the latency above comes from kernel receive timestamps. */
+    uint64_t user_latency_sum;
+    uint64_t user_latency_min;
+    uint64_t user_latency_max;
 } stats_t;
 
-typedef ISC_LIST(struct query_info) query_list;
+/*
+ * Counters per local address, kept when sending from several.  The
+ * sender counts queries sent, the receiver what became of them.
+ */
+typedef struct
+{
+    uint64_t num_sent;
+    uint64_t num_completed;
+    uint64_t num_timedout;
+    uint64_t latency_sum;
+} source_stats_t;
+
+/*
+ * Responses by the CPU the kernel processed them on (SO_INCOMING_CPU),
+ * kept with -O incoming-cpu.
+ */
+typedef struct
+{
+    uint64_t num_completed;
+    uint64_t latency_sum;
+    uint64_t latency_min;
+    uint64_t latency_max;
+} cpu_stats_t;
+
+/*
+ * Latency by response code and by query type.  The receiver allocates
+ * a histogram the first time it sees a code or type.  Types are kept
+ * in a small open-addressed table; those past MAX_QTYPES distinct ones
+ * are left out of the breakdown.
+ */
+#define MAX_QTYPES 64
+
+typedef struct
+{
+    struct perf_hist *rcode[16];
+    uint16_t qtypes[MAX_QTYPES];
+    struct perf_hist *qtype[MAX_QTYPES];
+} breakdown_t;
+
+/*
+ * Query slots move between the sender and the receiver without a lock.
+ * The state says who owns a slot: the sender from taking its ID until
+ * the query is on the wire, the receiver while it is outstanding.  The
+ * receiver retires a slot with a compare-and-swap, because the sender
+ * takes back slots whose send failed; retired IDs go back to the sender
+ * through a single-producer/single-consumer ring.
+ */
+enum
+{
+    QUERY_FREE,
+    QUERY_RESERVED,
+    QUERY_OUTSTANDING,
+};
 
 typedef struct query_info
 {
     uint64_t timestamp;
-    query_list *list;
+    uint64_t intended; /* scheduled send time, with -O open-loop */
+    uint64_t timeout;
+    uint32_t gen; /* bumped each time the ID is handed out */
+    uint32_t state;
+    uint16_t qtype;
     char *desc;
     struct perf_net_socket *sock;
-    /*
-     * This link links the query into the list of outstanding
-     * queries or the list of available query IDs.
-     */
-    ISC_LINK(struct query_info)
-    link;
 } query_info;
 
 #define NQIDS 65536
 
+/*
+ * Free query IDs, oldest first so an ID is reused as late as possible.
+ * The ring holds every ID, so it never fills up.  A sender that runs
+ * out of IDs (or of outstanding query credit) sets sleeping and waits
+ * on wake; the receiver only bumps wake when it sees sleeping.
+ */
+#define CACHE_LINE 64
+
+typedef struct
+{
+    uint32_t head; /* sender */
+    uint32_t sleeping;
+    char pad0[CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t tail; /* receiver */
+    uint32_t next; /* staged, not yet published */
+    char pad1[CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t wake;
+    char pad2[CACHE_LINE - sizeof(uint32_t)];
+    uint16_t ids[NQIDS];
+} qid_ring_t;
+
+/*
+ * A thread's counters, split by the role that writes them: the sender,
+ * and the receiver, which also expires queries.  Each block sits on
+ * cache lines of its own in threadinfo_t and is updated once per round
+ * inside a sequence lock, which costs the writer two stores to a line
+ * it already owns.  The reporter copies a block with stats_snapshot()
+ * and tries again if a round was under way, so a report never sees half
+ * a round.  Counters the other role also reads on its own (num_sent,
+ * num_completed) are read with atomic loads.
+ */
+typedef struct
+{
+    uint32_t seq;
+    uint64_t num_sent;
+    uint64_t num_late; /* over LATE_THRESHOLD behind the -Q schedule */
+    uint64_t num_unsent; /* due by the end of the run, never sent */
+    bool unsent_estimated; /* num_unsent from the mean rate */
+    uint64_t total_request_size;
+} send_stats_t;
+
+typedef struct
+{
+    uint32_t seq;
+    uint64_t num_completed;
+    uint64_t num_timedout;
+    uint64_t num_interrupted; /* by the main thread, after the run */
+    uint64_t total_response_size;
+    uint64_t rcodecounts[16];
+    uint64_t latency_sum;
+    double latency_sum_squares;
+    uint64_t latency_min;
+    uint64_t latency_max;
+    uint64_t user_latency_sum;
+    uint64_t user_latency_min;
+    uint64_t user_latency_max;
+} recv_stats_t;
+
+/*
+ * Query timeouts.  The sender hands every query it sent to the receiver
+ * through a single-producer, single-consumer ring of (id, generation,
+ * deadline) records: it publishes them with a release store of the
+ * tail, and the receiver drains them into a private hierarchical timer
+ * wheel, so the handoff takes no lock.  Four levels of 64 slots at a
+ * 1 ms tick cover 4.6 hours, and longer deadlines wait in the last
+ * level until they cascade down.  Advancing the wheel costs O(1) per
+ * tick plus the timers that expire.  A record may be stale (the send
+ * failed, or the response was processed first), so expiry checks the
+ * query's generation and claims the query before retiring it.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK MILLION /* nanoseconds */
+#define TIMER_NIL UINT32_MAX
+
+typedef struct
+{
+    uint32_t qid;
+    uint32_t gen;
+    uint64_t deadline;
+} sent_record_t;
+
+typedef struct
+{
+    uint64_t tick;
+    uint32_t gen;
+    uint32_t prev, next;
+    uint16_t bucket;
+    bool linked;
+} query_timer_t;
+
+typedef struct
+{
+    uint64_t now_tick;
+    uint32_t buckets[WHEEL_LEVELS * WHEEL_SIZE];
+    query_timer_t timers[NQIDS];
+} timer_wheel_t;
+
 typedef struct
 {
     query_info queries[NQIDS];
-    query_list outstanding_queries;
-    query_list unused_queries;
+    qid_ring_t free_ids;
 
-    pthread_t sender;
+    pthread_t sender; /* the only thread with the run-to-completion engine */
     pthread_t receiver;
-
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
+    int cpu;      /* of the thread that receives */
+    int send_cpu; /* of the sender in the split engine */
+    int node;     /* NUMA node of cpu, -1 if unknown */
 
     unsigned int nsocks;
+    unsigned int socket_offset; /* of the first socket among all threads' */
     int current_sock;
     struct perf_net_socket *socks;
+    struct perf_os_poller poller;
+    struct perf_net_uring *uring;
+    struct perf_net_xdp *xdp;
 
     perf_dnsctx_t *dnsctx;
 
@@ -189,17 +402,60 @@ typedef struct
 
     const config_t *config;
     const times_t *times;
-    stats_t stats;
+    char pad0[CACHE_LINE];
+    send_stats_t send_stats;
+    char pad1[CACHE_LINE - sizeof(send_stats_t) % CACHE_LINE];
+    recv_stats_t recv_stats;
+    char pad2[CACHE_LINE - sizeof(recv_stats_t) % CACHE_LINE];
+    source_stats_t *sources; /* per local address, NULL with just one */
+    cpu_stats_t *incoming;   /* PERF_OS_MAX_CPUS, NULL without -O incoming-cpu */
+    uint64_t steer_next;     /* completions at which to steer the receiver again */
+
+    /* Time between the receiver's polls with -O busy-poll, in log2 ns
+     * buckets: how late the tool can notice a response. */
+    uint64_t poll_gaps[64];
+    uint64_t poll_gap_max;
 
     uint32_t max_outstanding;
     uint32_t max_qps;
 
+    /* Sent queries on their way to the receiver's timer wheel. */
+    sent_record_t *sent;
+    uint32_t sent_head;
+    uint32_t sent_tail;
+    timer_wheel_t *wheel;
+
     uint64_t last_recv;
+    struct perf_hist latency; /* of every completion */
+    /* With -Q, the sender's schedule and how far behind it each query
+     * left; with -O open-loop also latency from the scheduled send
+     * time, kept by the receiver. */
+    struct perf_arrival *arrival;
+    struct perf_hist send_lag;
+    struct perf_hist corrected;
+    /* With kernel timestamps, latency to the receiver's own clock. */
+    struct perf_hist user_latency;
+    breakdown_t breakdown;
+    struct perf_capture_buf *capture; /* -w, NULL without */
+
+    /*
+     * Latency of the current -S interval.  The receiver records into
+     * interval[gen & 1] of the generation it read at the start of a
+     * round and acknowledges that generation at its end.  The reporter
+     * bumps the generation and takes the other histogram once the
+     * receiver has moved on, so it is the only side that ever waits.
+     */
+    struct perf_hist interval[2];
+    uint32_t interval_gen;
+    uint32_t interval_ack;
+    bool recv_exited;
     uint64_t *latency_detail; // 存储明细数据的变量，只能用堆，不能用栈，因为栈的大小不够
     uint64_t latency_num;     // 当前位置
+    uint64_t latency_dropped; /* completions past the -C limit */
 } threadinfo_t;
 
 static threadinfo_t *threads;
+static struct perf_capture *capture; /* -w */
 
 static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
@@ -248,14 +504,48 @@ print_initial_status(const config_t *config)
     printf("[Status] Stopping after ");
     if (config->timelimit)
         printf("%u.%06u seconds",
-               (unsigned int)(config->timelimit / MILLION),
-               (unsigned int)(config->timelimit % MILLION));
+               (unsigned int)(config->timelimit / BILLION),
+               (unsigned int)(config->timelimit % BILLION / 1000));
     if (config->timelimit && config->maxruns)
         printf(" or ");
     if (config->maxruns)
         printf("%u run%s through file", config->maxruns,
                config->maxruns == 1 ? "" : "s");
     printf("\n");
+
+    if (perf_os_clock.source == perf_os_clock_tsc)
+        printf("[Status] Clock: %s (%.3f GHz)\n", perf_os_clock_name(),
+               perf_os_clock_tschz() / 1e9);
+    else
+        printf("[Status] Clock: %s\n", perf_os_clock_name());
+    if (config->kernel_timestamps)
+        printf("[Status] Measuring latency to kernel receive timestamps\n");
+    if (config->rtc)
+        printf("[Status] Engine: run-to-completion\n");
+    if (config->busy_poll)
+    {
+        printf("[Status] Busy polling");
+        if (config->busy_poll_usec > 0)
+            printf(", SO_BUSY_POLL %u us", config->busy_poll_usec);
+        printf("\n");
+    }
+    if (config->ncpus > 0)
+    {
+        printf("[Status] CPUs:");
+        for (i = 0; i < config->ncpus; i++)
+            printf("%s%d", i == 0 ? " " : ",", config->cpus[i]);
+        printf("%s\n", config->cpus_auto ? " (auto, outside the RPS cpuset)" : "");
+    }
+    if (config->incoming_cpu)
+        printf("[Status] Counting responses by receiving CPU%s\n",
+               config->incoming_steer ? ", steering receivers to it" : "");
+    if (config->file_name != NULL)
+        printf("[Status] Capturing responses to %s\n", config->file_name);
+    if (config->port_last != 0)
+        printf("[Status] Source ports: %u-%u\n", config->port_first, config->port_last);
+    if (config->net_flags & PERF_NET_XDP)
+        printf("[Status] AF_XDP: %s queue %u%s\n", config->xdp.ifname,
+               config->xdp.queue, config->xdp.native ? " (native)" : "");
 }
 
 static void
@@ -275,7 +565,7 @@ print_final_status(const config_t *config)
 }
 
 static double
-stddev(uint64_t sum_of_squares, uint64_t sum, uint64_t total)
+stddev(double sum_of_squares, uint64_t sum, uint64_t total)
 {
     double squared;
 
@@ -283,71 +573,92 @@ stddev(uint64_t sum_of_squares, uint64_t sum, uint64_t total)
     return sqrt((sum_of_squares - (squared / total)) / (total - 1));
 }
 
-void swap(float *a, float *b)
-{
-    float temp;
-
-    temp = *a;
-    *a = *b;
-    *b = temp;
-}
+static const double exact_pcts[] = {10, 20, 30, 40, 50, 60, 70, 80, 90, 95, 99, 99.9, 99.99};
+#define NPCTS (sizeof(exact_pcts) / sizeof(exact_pcts[0]))
 
-// 3分快速排序
-void quickSort3Way(float a[], int left, int right)
+/*
+ * Percentiles of the samples kept with -C, selected in place from the
+ * threads' buffers by all online CPUs.  They are exact only if -C kept
+ * every completion, which the header says.
+ */
+static int
+print_exact_statistics(const config_t *config, const stats_t *stats,
+                       const threadinfo_t *p_threads)
 {
-    if (left < right)
+    struct perf_select_span *spans;
+    uint64_t ranks[NPCTS + 2], values[NPCTS + 2];
+    uint64_t count, dropped;
+    long ncpus;
+    unsigned int i;
+
+    spans = calloc(config->threads, sizeof(*spans));
+    if (spans == NULL)
+        return -1;
+    count = dropped = 0;
+    for (i = 0; i < config->threads; i++)
     {
-        float x = a[right];
-        int i = left - 1, j = right, p = left - 1, q = right;
-        for (;;)
-        {
-            while (a[++i] < x)
-            {
-            }
-            while (a[--j] > x)
-            {
-                if (j == left)
-                    break;
-            }
-            if (i < j)
-            {
-                swap(&a[i], &a[j]);
-                if (a[i] == x)
-                {
-                    p++;
-                    swap(&a[p], &a[i]);
-                }
-                if (a[j] == x)
-                {
-                    q--;
-                    swap(&a[q], &a[j]);
-                }
-            }
-            else
-                break;
-        }
-        swap(&a[i], &a[right]);
-        j = i - 1;
-        i = i + 1;
-        int k;
-        for (k = left; k <= p; k++, j--)
-            swap(&a[k], &a[j]);
-        for (k = right - 1; k >= q; k--, i++)
-            swap(&a[i], &a[k]);
+        spans[i].values = p_threads[i].latency_detail;
+        spans[i].count = p_threads[i].latency_num;
+        count += spans[i].count;
+        dropped += p_threads[i].latency_dropped;
+    }
+    if (count == 0)
+    {
+        free(spans);
+        return 0;
+    }
 
-        quickSort3Way(a, left, j);
-        quickSort3Way(a, i, right);
+    ranks[0] = 0;
+    for (i = 0; i < NPCTS; i++)
+        ranks[i + 1] = perf_select_rank(count, exact_pcts[i]);
+    ranks[NPCTS + 1] = count - 1;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (perf_select(spans, config->threads, stats->latency_max, ranks, NPCTS + 2,
+                    values, ncpus > 0 ? ncpus : 1) != 0)
+    {
+        free(spans);
+        return -1;
     }
+    free(spans);
+
+    printf("\n");
+    printf("  raw latency samples (%" PRIu64 " of %" PRIu64 " completions, %s):\n",
+           count, stats->num_completed,
+           count < stats->num_completed ? "the first of each thread only" : "exact");
+    printf("  ======================================\n");
+    printf("  Latency avg    %.3f (ms)\n",
+           (double)SAFE_DIV(stats->latency_sum, stats->num_completed) / MILLION);
+    printf("  Latency min    %.3f (ms)\n", (double)values[0] / MILLION);
+    for (i = 0; i < NPCTS; i++)
+        printf("  Latency p%-6g%.3f (ms)\n", exact_pcts[i], (double)values[i + 1] / MILLION);
+    printf("  Latency max    %.3f (ms)\n", (double)values[NPCTS + 1] / MILLION);
+    if (dropped > 0)
+        printf("  Samples not kept: %" PRIu64 " (past the -C limit of %" PRIu64 " per thread)\n",
+               dropped, g_details);
+    return 0;
 }
 
-void show_data_detail(float *p)
+/*
+ * The percentile table of one latency histogram.
+ */
+static void
+print_percentiles(const char *title, const struct perf_hist *hist, uint64_t avg)
 {
-    uint64_t sum_pos = 0;
-    while (p[sum_pos] != 0)
-    {
-        printf("No.%u data=%.3f\n", sum_pos + 1, p[sum_pos]);
-        sum_pos++;
-    }
+    unsigned int i;
+
+    printf("\n");
+    printf("  %s (%" PRIu64 " samples, %u significant digits):\n",
+           title, hist->count, hist->digits);
+    printf("  ======================================\n");
+    printf("  Latency avg    %.3f (ms)\n", (double)avg / MILLION);
+    printf("  Latency min    %.3f (ms)\n", (double)hist->min / MILLION);
+    for (i = 10; i <= 90; i += 10)
+        printf("  Latency p%u    %.3f (ms)\n", i, (double)perf_hist_percentile(hist, i) / MILLION);
+    printf("  Latency p95    %.3f (ms)\n", (double)perf_hist_percentile(hist, 95) / MILLION);
+    printf("  Latency p99    %.3f (ms)\n", (double)perf_hist_percentile(hist, 99) / MILLION);
+    printf("  Latency p99.9  %.3f (ms)\n", (double)perf_hist_percentile(hist, 99.9) / MILLION);
+    printf("  Latency p99.99 %.3f (ms)\n", (double)perf_hist_percentile(hist, 99.99) / MILLION);
+    printf("  Latency max    %.3f (ms)\n", (double)hist->max / MILLION);
 }
 
 static void
@@ -357,13 +668,9 @@ print_statistics(const config_t *config, const times_t *times, stats_t *stats,
     const char *units;
     uint64_t run_time;
     bool first_rcode;
-    uint64_t latency_avg;
+    uint64_t latency_avg, truncated;
     unsigned int i, j;
-    uint64_t t_pos = 0;
-    uint64_t sum_pos = 0;
-    threadinfo_t *tinfo = NULL;
-    float sum_time = 0.f;
-    float temp = 0.0f;
+    struct perf_hist hist;
 
     units = config->updates ? "Updates" : "Queries";
     run_time = times->end_time - times->start_time;
@@ -381,6 +688,13 @@ print_statistics(const config_t *config, const times_t *times, stats_t *stats,
         printf("  %s interrupted:  %" PRIu64 " (%.2lf%%)\n",
                units, stats->num_interrupted,
                SAFE_DIV(100.0 * stats->num_interrupted, stats->num_sent));
+    truncated = 0;
+    for (j = 0; j < config->threads && p_threads != NULL; j++)
+        if (p_threads[j].uring != NULL)
+            truncated += perf_net_uring_truncated(p_threads[j].uring);
+    if (truncated > 0)
+        printf("  Responses truncated:  %" PRIu64 " (larger than the io_uring "
+               "buffers, counted as lost)\n", truncated);
     printf("\n");
 
     printf("  Response codes:       ");
@@ -404,174 +718,650 @@ print_statistics(const config_t *config, const times_t *times, stats_t *stats,
            (unsigned int)SAFE_DIV(stats->total_response_size,
                                   stats->num_completed));
     printf("  Run time (s):         %u.%06u\n",
-           (unsigned int)(run_time / MILLION),
-           (unsigned int)(run_time % MILLION));
+           (unsigned int)(run_time / BILLION),
+           (unsigned int)(run_time % BILLION / 1000));
     printf("  %s per second:   %.6lf\n", units,
-           SAFE_DIV(stats->num_completed, (((double)run_time) / MILLION)));
+           SAFE_DIV(stats->num_completed, (((double)run_time) / BILLION)));
 
     printf("\n");
 
     latency_avg = SAFE_DIV(stats->latency_sum, stats->num_completed);
     printf("  Average Latency (s):  %u.%06u (min %u.%06u, max %u.%06u)\n",
-           (unsigned int)(latency_avg / MILLION),
-           (unsigned int)(latency_avg % MILLION),
-           (unsigned int)(stats->latency_min / MILLION),
-           (unsigned int)(stats->latency_min % MILLION),
-           (unsigned int)(stats->latency_max / MILLION),
-           (unsigned int)(stats->latency_max % MILLION));
+           (unsigned int)(latency_avg / BILLION),
+           (unsigned int)(latency_avg % BILLION / 1000),
+           (unsigned int)(stats->latency_min / BILLION),
+           (unsigned int)(stats->latency_min % BILLION / 1000),
+           (unsigned int)(stats->latency_max / BILLION),
+           (unsigned int)(stats->latency_max % BILLION / 1000));
     if (stats->num_completed > 1)
     {
         printf("  Latency StdDev (s):   %f\n",
                stddev(stats->latency_sum_squares, stats->latency_sum,
                       stats->num_completed) /
-                   MILLION);
+                   BILLION);
+    }
+    if (config->kernel_timestamps)
+    {
+        latency_avg = SAFE_DIV(stats->user_latency_sum, stats->num_completed);
+        printf("  Userspace Latency (s): %u.%06u (min %u.%06u, max %u.%06u)\n",
+               (unsigned int)(latency_avg / BILLION),
+               (unsigned int)(latency_avg % BILLION / 1000),
+               (unsigned int)(stats->user_latency_min / BILLION),
+               (unsigned int)(stats->user_latency_min % BILLION / 1000),
+               (unsigned int)(stats->user_latency_max / BILLION),
+               (unsigned int)(stats->user_latency_max % BILLION / 1000));
+        latency_avg = SAFE_DIV(stats->latency_sum, stats->num_completed);
     }
 
     // 打印每个线程延迟
-    printf("  Latency thread=%d calucating begin ...\n", config->threads);
     if (p_threads == NULL)
     {
         printf("ERROR: no threads find\n");
         return;
     }
 
-    // 统计数字初始化
-    stats->p_data = NULL;
-    stats->data_num = 0;
-    stats->avg_time = 0.0f;
-    stats->min_time = 0.0f;
-    stats->max_time = 0.0f;
-    stats->p95_time = 0.0f;
-    stats->p99_time = 0.0f;
-
-    // 统计有效数据个数
+    /*
+     * Percentiles of every completion, from the threads' histograms
+     * merged.
+     */
+    if (perf_hist_init(&hist, config->precision) < 0)
+        perf_log_fatal("out of memory");
     for (j = 0; j < config->threads; j++)
+        perf_hist_merge(&hist, &p_threads[j].latency);
+    print_percentiles("latency statistics", &hist, latency_avg);
+    perf_hist_destroy(&hist);
+
+    if (config->kernel_timestamps)
     {
-        tinfo = &p_threads[j];
-        stats->data_num += tinfo->latency_num;
+        if (perf_hist_init(&hist, config->precision) < 0)
+            perf_log_fatal("out of memory");
+        for (j = 0; j < config->threads; j++)
+            perf_hist_merge(&hist, &p_threads[j].user_latency);
+        print_percentiles("userspace latency statistics", &hist,
+                          SAFE_DIV(stats->user_latency_sum, stats->num_completed));
+        perf_hist_destroy(&hist);
     }
 
-    // 分配内存
-    stats->p_data = (float *)malloc(stats->data_num * sizeof(float) + 1);
-    if (stats->p_data == NULL)
-    {
-        printf("ERROR: malloc memory failed\n");
+    /* With -C, the same exactly, from the raw samples. */
+    if (g_details > 0 && print_exact_statistics(config, stats, p_threads) != 0)
+        perf_log_warning("cannot find the exact percentiles: %s", strerror(errno));
+    printf("\n");
+}
+
+/*
+ * One line per local address, when sending from several.
+ */
+static void
+print_source_statistics(const config_t *config)
+{
+    source_stats_t total;
+    char name[INET6_ADDRSTRLEN];
+    uint64_t latency_avg;
+    unsigned int i, j;
+
+    if (config->nlocal < 2)
         return;
-    }
-    memset(stats->p_data, 0, (stats->data_num + 1) * sizeof(float));
 
-    // 数据拷贝
-    sum_pos = 0;
-    for (j = 0; j < config->threads; j++)
+    printf("  Per source address:\n");
+    for (i = 0; i < config->nlocal; i++)
     {
-        tinfo = &p_threads[j];
-        for (t_pos = 0; t_pos < tinfo->latency_num; t_pos++)
+        memset(&total, 0, sizeof(total));
+        for (j = 0; j < config->threads; j++)
         {
-            stats->p_data[sum_pos] = (float)tinfo->latency_detail[t_pos] / 1000;
-            sum_pos++;
+            total.num_sent += threads[j].sources[i].num_sent;
+            total.num_completed += threads[j].sources[i].num_completed;
+            total.num_timedout += threads[j].sources[i].num_timedout;
+            total.latency_sum += threads[j].sources[i].latency_sum;
         }
+        if (isc_sockaddr_pf(&config->local_addrs[i]) == AF_INET6)
+            inet_ntop(AF_INET6, &config->local_addrs[i].type.sin6.sin6_addr, name, sizeof(name));
+        else
+            inet_ntop(AF_INET, &config->local_addrs[i].type.sin.sin_addr, name, sizeof(name));
+        latency_avg = SAFE_DIV(total.latency_sum, total.num_completed);
+        printf("    %-39s sent %" PRIu64 ", completed %" PRIu64 " (%.2lf%%), "
+               "lost %" PRIu64 ", avg latency %u.%06u\n",
+               name, total.num_sent, total.num_completed,
+               SAFE_DIV(100.0 * total.num_completed, total.num_sent),
+               total.num_timedout,
+               (unsigned int)(latency_avg / BILLION),
+               (unsigned int)(latency_avg % BILLION / 1000));
     }
+    printf("\n");
+}
 
-    // debug输出每个数据明细
-    // show_data_detail(stats->p_data);
+/*
+ * The histogram of a query type in a breakdown table, allocated on
+ * first use, or NULL if the table is full.
+ */
+static struct perf_hist *
+breakdown_qtype(const config_t *config, breakdown_t *b, uint16_t qtype)
+{
+    unsigned int i, n;
 
-    // 3分快速排序,效率最高
-    // quicksort(stats->p_data, stats->data_num, 0, stats->data_num-1);
-    quickSort3Way(stats->p_data, 0, stats->data_num - 1);
+    for (i = qtype % MAX_QTYPES, n = 0; n < MAX_QTYPES; i = (i + 1) % MAX_QTYPES, n++)
+    {
+        if (b->qtype[i] == NULL)
+        {
+            b->qtype[i] = malloc(sizeof(*b->qtype[i]));
+            if (b->qtype[i] == NULL || perf_hist_init(b->qtype[i], config->precision) < 0)
+                perf_log_fatal("out of memory");
+            b->qtypes[i] = qtype;
+        }
+        if (b->qtypes[i] == qtype)
+            return b->qtype[i];
+    }
+    return NULL;
+}
 
-    // 最小最大
-    stats->min_time = stats->p_data[0];
-    stats->max_time = stats->p_data[stats->data_num - 1];
+static void
+free_breakdown(breakdown_t *b)
+{
+    unsigned int i;
 
-    // 平均
-    stats->avg_time = (double) latency_avg / MILLION * 1000;
+    for (i = 0; i < 16; i++)
+    {
+        if (b->rcode[i] != NULL)
+            perf_hist_destroy(b->rcode[i]);
+        free(b->rcode[i]);
+    }
+    for (i = 0; i < MAX_QTYPES; i++)
+    {
+        if (b->qtype[i] != NULL)
+            perf_hist_destroy(b->qtype[i]);
+        free(b->qtype[i]);
+    }
+}
 
-    // P95
-    t_pos = stats->data_num * 95 / 100;
-    stats->p95_time = stats->p_data[t_pos];
+static void
+print_breakdown_line(const char *name, const struct perf_hist *h)
+{
+    printf("    %-12s count %-10" PRIu64 " avg %.3f  p50 %.3f  p99 %.3f  max %.3f\n",
+           name, h->count, (double)h->sum / h->count / MILLION,
+           (double)perf_hist_percentile(h, 50) / MILLION,
+           (double)perf_hist_percentile(h, 99) / MILLION,
+           (double)h->max / MILLION);
+}
 
-    // P99
-    t_pos = stats->data_num * 99 / 100;
-    stats->p99_time = stats->p_data[t_pos];
+/*
+ * Latency by response code and by query type, merged over the threads.
+ */
+static void
+print_breakdown(const config_t *config)
+{
+    breakdown_t total;
+    const breakdown_t *b;
+    struct perf_hist *h;
+    char name[32];
+    unsigned int i, j, next;
+    int last;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < config->threads; i++)
+    {
+        b = &threads[i].breakdown;
+        for (j = 0; j < 16; j++)
+        {
+            if (b->rcode[j] == NULL)
+                continue;
+            if (total.rcode[j] == NULL)
+            {
+                total.rcode[j] = malloc(sizeof(*total.rcode[j]));
+                if (total.rcode[j] == NULL || perf_hist_init(total.rcode[j], config->precision) < 0)
+                    perf_log_fatal("out of memory");
+            }
+            perf_hist_merge(total.rcode[j], b->rcode[j]);
+        }
+        for (j = 0; j < MAX_QTYPES; j++)
+        {
+            if (b->qtype[j] != NULL && (h = breakdown_qtype(config, &total, b->qtypes[j])) != NULL)
+                perf_hist_merge(h, b->qtype[j]);
+        }
+    }
 
-    // 打印统计
+    printf("  Latency by response code (ms):\n");
+    for (j = 0; j < 16; j++)
+    {
+        if (total.rcode[j] != NULL)
+            print_breakdown_line(perf_dns_rcode_strings[j], total.rcode[j]);
+    }
+    printf("  Latency by query type (ms):\n");
+    for (last = -1;; last = total.qtypes[next])
+    {
+        next = MAX_QTYPES;
+        for (j = 0; j < MAX_QTYPES; j++)
+        {
+            if (total.qtype[j] != NULL && total.qtypes[j] > last &&
+                (next == MAX_QTYPES || total.qtypes[j] < total.qtypes[next]))
+                next = j;
+        }
+        if (next == MAX_QTYPES)
+            break;
+        dns_rdatatype_format(total.qtypes[next], name, sizeof(name));
+        print_breakdown_line(name, total.qtype[next]);
+    }
     printf("\n");
-    printf("  latency statistics (%d samples):\n", stats->data_num);
-    printf("  ======================================\n");
-    printf("  Latency avg    %.3f (ms)\n", stats->avg_time);
-    printf("  Latency min    %.3f (ms)\n", stats->min_time);
 
-    // 分段打印
-    for (i = 10; i <= 90; i += 10)
-        printf("  Latency p%d    %.3f (ms)\n", i, (float)stats->p_data[stats->data_num * i / 100]);
+    free_breakdown(&total);
+}
 
-    printf("  Latency p95    %.3f (ms)\n", stats->p95_time);
-    printf("  Latency p99    %.3f (ms)\n", stats->p99_time);
-    printf("  Latency max    %.3f (ms)\n", stats->max_time);
+/*
+ * Add up the threads' per-CPU receive counters into total, which has
+ * PERF_OS_MAX_CPUS entries.
+ */
+static void
+sum_incoming(const config_t *config, cpu_stats_t *total)
+{
+    const cpu_stats_t *c;
+    unsigned int i;
+    int cpu;
 
-    // 释放有效数据内存
-    if (stats->p_data != NULL)
+    memset(total, 0, PERF_OS_MAX_CPUS * sizeof(*total));
+    for (i = 0; i < config->threads; i++)
     {
-        free(stats->p_data);
-        stats->p_data = NULL;
+        for (cpu = 0; cpu < PERF_OS_MAX_CPUS; cpu++)
+        {
+            c = &threads[i].incoming[cpu];
+            if (c->num_completed == 0)
+                continue;
+            if (c->latency_min < total[cpu].latency_min || total[cpu].num_completed == 0)
+                total[cpu].latency_min = c->latency_min;
+            if (c->latency_max > total[cpu].latency_max)
+                total[cpu].latency_max = c->latency_max;
+            total[cpu].latency_sum += c->latency_sum;
+            total[cpu].num_completed += c->num_completed;
+        }
     }
-    printf("\n");
 }
 
+/*
+ * With -Q, how far behind the schedule queries left.  With -O open-loop
+ * also latency from the actual send time next to latency from the
+ * scheduled one, which charges a stall of the server to every query it
+ * held back.
+ */
 static void
-sum_stats(const config_t *config, stats_t *total)
+print_schedule_statistics(const config_t *config, const stats_t *stats)
 {
-    unsigned int i, j;
+    static const double pcts[] = {50, 90, 95, 99, 99.9, 99.99};
+    struct perf_hist latency, corrected, lag;
+    char model[64];
+    unsigned int i;
 
-    memset(total, 0, sizeof(*total));
+    if (config->max_qps == 0)
+        return;
 
+    if (perf_hist_init(&latency, config->precision) < 0 ||
+        perf_hist_init(&corrected, config->precision) < 0 ||
+        perf_hist_init(&lag, config->precision) < 0)
+        perf_log_fatal("out of memory");
     for (i = 0; i < config->threads; i++)
     {
-        stats_t *stats = &threads[i].stats;
+        perf_hist_merge(&latency, &threads[i].latency);
+        perf_hist_merge(&lag, &threads[i].send_lag);
+        if (config->open_loop)
+            perf_hist_merge(&corrected, &threads[i].corrected);
+    }
 
-        for (j = 0; j < 16; j++)
-            total->rcodecounts[j] += stats->rcodecounts[j];
+    perf_arrival_format(&config->arrival, model, sizeof(model));
+    printf("  Schedule (%s, %u queries/s%s):\n", model, config->max_qps,
+           config->open_loop ? ", open loop" : "");
+    printf("    Sent late:    %" PRIu64 " (%.2lf%%), more than %u ms behind the schedule%s\n",
+           stats->num_late, SAFE_DIV(100.0 * stats->num_late, stats->num_sent),
+           (unsigned int)(LATE_THRESHOLD / MILLION),
+           config->open_loop ? "" : " (includes waits for a free -q slot)");
+    printf("    Not sent:     %s%" PRIu64 " (%.2lf%%), due before the end of the run%s\n",
+           stats->unsent_estimated ? "~" : "", stats->num_unsent,
+           SAFE_DIV(100.0 * stats->num_unsent, stats->num_sent + stats->num_unsent),
+           stats->unsent_estimated ? " (estimated from the mean rate)" : "");
+    printf("    Behind by:    p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f (us)\n",
+           (double)perf_hist_percentile(&lag, 50) / 1000,
+           (double)perf_hist_percentile(&lag, 90) / 1000,
+           (double)perf_hist_percentile(&lag, 99) / 1000,
+           (double)perf_hist_percentile(&lag, 99.9) / 1000,
+           (double)lag.max / 1000);
+    printf("\n");
 
-        total->num_sent += stats->num_sent;
-        total->num_interrupted += stats->num_interrupted;
-        total->num_timedout += stats->num_timedout;
-        total->num_completed += stats->num_completed;
+    if (config->open_loop)
+    {
+        printf("    Latency (ms)   uncorrected    corrected\n");
+        printf("    avg         %14.3f %12.3f\n",
+               SAFE_DIV((double)latency.sum, latency.count) / MILLION,
+               SAFE_DIV((double)corrected.sum, corrected.count) / MILLION);
+        for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            printf("    p%-10g %14.3f %12.3f\n", pcts[i],
+                   (double)perf_hist_percentile(&latency, pcts[i]) / MILLION,
+                   (double)perf_hist_percentile(&corrected, pcts[i]) / MILLION);
+        printf("    max         %14.3f %12.3f\n",
+               (double)latency.max / MILLION, (double)corrected.max / MILLION);
+        printf("\n");
+    }
 
-        total->total_request_size += stats->total_request_size;
-        total->total_response_size += stats->total_response_size;
+    perf_hist_destroy(&lag);
+    perf_hist_destroy(&corrected);
+    perf_hist_destroy(&latency);
+}
 
-        total->latency_sum += stats->latency_sum;
-        total->latency_sum_squares += stats->latency_sum_squares;
-        // 时间计算
-        if (stats->latency_min < total->latency_min || i == 0)
-            total->latency_min = stats->latency_min;
-        if (stats->latency_max > total->latency_max)
-            total->latency_max = stats->latency_max;
+/*
+ * One line per CPU responses were processed on, with -O incoming-cpu.
+ */
+static void
+print_incoming_statistics(const config_t *config)
+{
+    cpu_stats_t *total;
+    uint64_t num_completed, latency_avg;
+    int cpu;
+
+    if (!config->incoming_cpu)
+        return;
+
+    total = calloc(PERF_OS_MAX_CPUS, sizeof(*total));
+    if (total == NULL)
+        perf_log_fatal("out of memory");
+    sum_incoming(config, total);
+    num_completed = 0;
+    for (cpu = 0; cpu < PERF_OS_MAX_CPUS; cpu++)
+        num_completed += total[cpu].num_completed;
+
+    printf("  Per receiving CPU (SO_INCOMING_CPU):\n");
+    for (cpu = 0; cpu < PERF_OS_MAX_CPUS; cpu++)
+    {
+        if (total[cpu].num_completed == 0)
+            continue;
+        latency_avg = total[cpu].latency_sum / total[cpu].num_completed;
+        printf("    CPU %-4d completed %" PRIu64 " (%.2lf%%), "
+               "latency avg %u.%06u min %u.%06u max %u.%06u\n",
+               cpu, total[cpu].num_completed,
+               100.0 * total[cpu].num_completed / num_completed,
+               (unsigned int)(latency_avg / BILLION),
+               (unsigned int)(latency_avg % BILLION / 1000),
+               (unsigned int)(total[cpu].latency_min / BILLION),
+               (unsigned int)(total[cpu].latency_min % BILLION / 1000),
+               (unsigned int)(total[cpu].latency_max / BILLION),
+               (unsigned int)(total[cpu].latency_max % BILLION / 1000));
     }
+    printf("\n");
+    free(total);
 }
 
-static char *
-stringify(unsigned int value)
+static int
+compare_u64(const void *a, const void *b)
 {
-    static char buf[20];
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-    snprintf(buf, sizeof(buf), "%u", value);
-    return buf;
+    return x < y ? -1 : x > y;
 }
 
+/*
+ * With busy polling, report what the tool itself adds to a measurement:
+ * the cost of a clock read, and the time between the receiver's polls,
+ * which bounds how late it notices a response.  Server jitter well
+ * above these is the server's.
+ */
 static void
-setup(int argc, char **argv, config_t *config)
+print_floor(const config_t *config)
 {
-    const char *family = NULL;
-    const char *server_name = DEFAULT_SERVER_NAME;
-    in_port_t server_port = 0;
-    const char *local_name = NULL;
-    in_port_t local_port = DEFAULT_LOCAL_PORT;
+    uint64_t reads[1001], t;
+    uint64_t gaps[64], npolls, gap_max, seen;
+    unsigned int i, j;
+    int p50, p99;
+
+    if (!config->busy_poll)
+        return;
+
+    for (i = 0; i < sizeof(reads) / sizeof(reads[0]); i++)
+    {
+        t = perf_os_clock_now();
+        reads[i] = perf_os_clock_now() - t;
+    }
+    qsort(reads, sizeof(reads) / sizeof(reads[0]), sizeof(reads[0]), compare_u64);
+
+    memset(gaps, 0, sizeof(gaps));
+    npolls = gap_max = 0;
+    for (i = 0; i < config->threads; i++)
+    {
+        for (j = 0; j < 64; j++)
+        {
+            gaps[j] += threads[i].poll_gaps[j];
+            npolls += threads[i].poll_gaps[j];
+        }
+        if (threads[i].poll_gap_max > gap_max)
+            gap_max = threads[i].poll_gap_max;
+    }
+    p50 = p99 = -1;
+    for (j = 0, seen = 0; j < 64; j++)
+    {
+        seen += gaps[j];
+        if (p50 < 0 && seen * 2 >= npolls)
+            p50 = j;
+        if (p99 < 0 && seen * 100 >= npolls * 99)
+            p99 = j;
+    }
+
+    printf("  Measurement floor:\n");
+    printf("    Clock read (ns):     min %" PRIu64 ", median %" PRIu64 "\n",
+           reads[0], reads[sizeof(reads) / sizeof(reads[0]) / 2]);
+    if (npolls > 0)
+        printf("    Receive polls (ns):  p50 < %" PRIu64 ", p99 < %" PRIu64
+               ", max %" PRIu64 " (%" PRIu64 " polls)\n",
+               (uint64_t)2 << p50, (uint64_t)2 << p99, gap_max, npolls);
+    printf("\n");
+}
+
+static inline void
+stats_write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+stats_write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy a counter block, whose first member is its sequence, as it was
+ * between two rounds of its writer.
+ */
+static void
+stats_snapshot(void *copy, const void *block, size_t len)
+{
+    const uint32_t *seq = block;
+    uint32_t before;
+
+    for (;;)
+    {
+        before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (before % 2 == 0)
+        {
+            memcpy(copy, block, len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+                return;
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * Add up the threads' counters.  Each thread's receiver block is copied
+ * before its sender block, so answers do not run ahead of sends, but
+ * for those that beat the sender's count of its own system call.
+ */
+static void
+sum_stats(const config_t *config, stats_t *total)
+{
+    send_stats_t sent;
+    recv_stats_t recvd;
+    recv_stats_t *stats = &recvd;
+    unsigned int i, j;
+
+    memset(total, 0, sizeof(*total));
+
+    for (i = 0; i < config->threads; i++)
+    {
+        stats_snapshot(&recvd, &threads[i].recv_stats, sizeof(recvd));
+        stats_snapshot(&sent, &threads[i].send_stats, sizeof(sent));
+
+        for (j = 0; j < 16; j++)
+            total->rcodecounts[j] += stats->rcodecounts[j];
+
+        total->num_sent += sent.num_sent;
+        total->num_late += sent.num_late;
+        total->num_unsent += sent.num_unsent;
+        total->unsent_estimated |= sent.unsent_estimated;
+        total->num_interrupted += stats->num_interrupted;
+        total->num_timedout += stats->num_timedout;
+        total->num_completed += stats->num_completed;
+
+        total->total_request_size += sent.total_request_size;
+        total->total_response_size += stats->total_response_size;
+
+        total->latency_sum += stats->latency_sum;
+        total->latency_sum_squares += stats->latency_sum_squares;
+        // 时间计算
+        if (stats->latency_min < total->latency_min || i == 0)
+            total->latency_min = stats->latency_min;
+        if (stats->latency_max > total->latency_max)
+            total->latency_max = stats->latency_max;
+
+        total->user_latency_sum += stats->user_latency_sum;
+        if (stats->user_latency_min < total->user_latency_min || i == 0)
+            total->user_latency_min = stats->user_latency_min;
+        if (stats->user_latency_max > total->user_latency_max)
+            total->user_latency_max = stats->user_latency_max;
+    }
+}
+
+static char *
+stringify(unsigned int value)
+{
+    static char buf[20];
+
+    snprintf(buf, sizeof(buf), "%u", value);
+    return buf;
+}
+
+static void
+parse_qtype_timeouts(config_t *config, const char *spec)
+{
+    qtype_timeout_t *qt;
+    const char *p, *colon;
+    char *end;
+    double seconds;
+    size_t len;
+
+    for (p = spec; *p != 0; p = *end == ',' ? end + 1 : end)
+    {
+        colon = strchr(p, ':');
+        len = colon != NULL ? (size_t)(colon - p) : 0;
+        if (len == 0 || len >= sizeof(qt->qtype))
+            perf_log_fatal("invalid qtype timeout: %s", p);
+        seconds = strtod(colon + 1, &end);
+        if (end == colon + 1 || seconds <= 0 || (*end != ',' && *end != 0))
+            perf_log_fatal("invalid qtype timeout: %s", p);
+        if (config->nqtype_timeouts == MAX_QTYPE_TIMEOUTS)
+            perf_log_fatal("too many qtype timeouts");
+        qt = &config->qtype_timeouts[config->nqtype_timeouts++];
+        memcpy(qt->qtype, p, len);
+        qt->qtype[len] = 0;
+        qt->timeout = (uint64_t)(seconds * BILLION);
+    }
+}
+
+/*
+ * A source port range gives each client its own port, so it sets the
+ * number of clients.
+ */
+static void
+parse_port_range(config_t *config, const char *spec)
+{
+    unsigned int first, last;
+    char extra;
+
+    if (sscanf(spec, "%u-%u%c", &first, &last, &extra) != 2 ||
+        first == 0 || first > last || last > 65535)
+        perf_log_fatal("invalid port range: %s", spec);
+    config->port_first = first;
+    config->port_last = last;
+    config->clients = last - first + 1;
+}
+
+/*
+ * Threads go on the CPUs of a list, or with "auto" on those the
+ * network stack does not steer received packets to.
+ */
+static void
+parse_cpus(config_t *config, const char *spec)
+{
+    int max, n;
+
+    max = PERF_OS_MAX_CPUS;
+    config->cpus = calloc(max, sizeof(*config->cpus));
+    if (config->cpus == NULL)
+        perf_log_fatal("out of memory");
+    if (strcmp(spec, "auto") == 0)
+    {
+        config->cpus_auto = true;
+        n = perf_os_autocpus(config->cpus, max);
+        if (n <= 0)
+            perf_log_warning("no CPUs found for placement, leaving threads unpinned");
+    }
+    else
+    {
+        n = perf_os_parsecpus(spec, config->cpus, max);
+        if (n <= 0)
+            perf_log_fatal("invalid CPU list: %s", spec);
+    }
+    if (n <= 0)
+    {
+        free(config->cpus);
+        config->cpus = NULL;
+        n = 0;
+    }
+    config->ncpus = n;
+}
+
+/*
+ * Files open during the run: the clients' sockets, stdio, the three
+ * pipes, the input and capture files, and per thread the epoll
+ * instance, io_uring ring or AF_XDP socket; AF_XDP adds the program,
+ * its map and the link.  FD_SLACK covers files open only briefly, such
+ * as /proc entries read while setting up.
+ */
+static unsigned int
+fds_needed(const config_t *config)
+{
+    unsigned int n;
+
+    n = config->clients + 3 + 6 + 1 + config->threads + FD_SLACK;
+    if (config->file_name != NULL)
+        n++;
+    if (config->net_flags & PERF_NET_XDP)
+        n += 3;
+    return n;
+}
+
+static void
+setup(int argc, char **argv, config_t *config)
+{
+    const char *family = NULL;
+    const char *server_name = DEFAULT_SERVER_NAME;
+    in_port_t server_port = 0;
+    const char *local_name = NULL;
+    in_port_t local_port = DEFAULT_LOCAL_PORT;
     const char *filename = NULL;
     const char *edns_option = NULL;
     const char *tsigkey = NULL;
     isc_result_t result;
     const char *mode = 0;
+    const char *qtype_timeouts = NULL;
+    const char *port_range = NULL;
+    const char *cpus = NULL;
+    const char *engine = NULL;
+    const char *arrival = NULL;
+    unsigned int nfds;
 
     result = isc_mem_create(0, 0, &mctx);
     if (result != ISC_R_SUCCESS)
@@ -589,19 +1379,30 @@ setup(int argc, char **argv, config_t *config)
     config->threads = 1;
     config->timeout = DEFAULT_TIMEOUT * MILLION;
     config->max_outstanding = DEFAULT_MAX_OUTSTANDING;
+    config->recv_batch = DEFAULT_RECV_BATCH;
+    config->send_batch = DEFAULT_SEND_BATCH;
+    config->precision = DEFAULT_PRECISION;
     config->mode = sock_udp;
 
     perf_opt_add('f', perf_opt_string, "family",
                  "address family of DNS transport, inet or inet6", "any",
                  &family);
-    perf_opt_add('m', perf_opt_string, "mode", "set transport mode: udp, tcp or tls", "udp", &mode);
+    perf_opt_add('m', perf_opt_string, "mode",
+                 "set transport mode: udp, tcp or tls; udp-uring and "
+                 "tcp-uring use the io_uring engine, udp-gso sends "
+                 "batches of equal-size queries with UDP GSO, udp-xdp "
+                 "uses AF_XDP on the -O xdp-dev interface",
+                 "udp", &mode);
     perf_opt_add('s', perf_opt_string, "server_addr",
                  "the server to query", DEFAULT_SERVER_NAME, &server_name);
     perf_opt_add('p', perf_opt_port, "port",
                  "the port on which to query the server",
                  DEFAULT_SERVER_PORTS, &server_port);
     perf_opt_add('a', perf_opt_string, "local_addr",
-                 "the local address from which to send queries", NULL,
+                 "the local address from which to send queries, or a comma "
+                 "separated list of addresses and CIDR blocks to spread the "
+                 "clients over (bound with IP_FREEBIND; at least one client "
+                 "per address)", NULL,
                  &local_name);
     perf_opt_add('x', perf_opt_port, "local_port",
                  "the local port from which to send queries",
@@ -650,19 +1451,129 @@ setup(int argc, char **argv, config_t *config)
                  "send dynamic updates instead of queries",
                  NULL, &config->updates);
     perf_opt_add('w', perf_opt_string, "output_file",
-                 "save detail data to output file",
+                 "stream every response to a binary capture file "
+                 "(contrib/capture2csv converts it)",
                  NULL, &config->file_name);
     perf_opt_add('C', perf_opt_uint, "detail_num",
-                 "detail packets per thread",
+                 "keep up to N million raw latency samples per thread "
+                 "for exact percentiles",
                  NULL, &config->details);
     perf_opt_add('v', perf_opt_boolean, NULL,
                  "verbose: report each query and additional information to stdout",
                  NULL, &config->verbose);
+    perf_long_opt_add("recv-batch", perf_opt_uint, "depth",
+                      "the number of responses to read per socket with one call",
+                      stringify(DEFAULT_RECV_BATCH), &config->recv_batch);
+    perf_long_opt_add("send-batch", perf_opt_uint, "count",
+                      "the number of queries to send with one call (UDP only)",
+                      stringify(DEFAULT_SEND_BATCH), &config->send_batch);
+    perf_long_opt_add("uring-sqpoll", perf_opt_boolean, NULL,
+                      "poll the io_uring submission queue from a kernel thread",
+                      NULL, &config->uring_sqpoll);
+    perf_long_opt_add("clock", perf_opt_string, "source",
+                      "clock for timestamps: raw (CLOCK_MONOTONIC_RAW) or tsc",
+                      "raw", &config->clock);
+    perf_long_opt_add("engine", perf_opt_string, "model",
+                      "split (a sender and a receiver thread per thread) or rtc (one pinned run-to-completion thread)",
+                      "split", &engine);
+    perf_long_opt_add("qtype-timeout", perf_opt_string, "type:sec[,...]",
+                      "per query type timeouts overriding -t, e.g. AAAA:2,ANY:10",
+                      NULL, &qtype_timeouts);
+    perf_long_opt_add("port-range", perf_opt_string, "first-last",
+                      "send from one client per source port in the range, "
+                      "split between the threads; overrides -c and -x",
+                      NULL, &port_range);
+    perf_long_opt_add("busy-poll", perf_opt_boolean, NULL,
+                      "never sleep in the receiver: spin on non-blocking readiness checks and "
+                      "reads on a pinned CPU, and report the tool's measurement floor",
+                      NULL, &config->busy_poll);
+    perf_long_opt_add("busy-poll-usec", perf_opt_uint, "usec",
+                      "with busy-poll, also let reads of ready sockets busy-poll the device queue "
+                      "(SO_BUSY_POLL, SO_PREFER_BUSY_POLL)",
+                      NULL, &config->busy_poll_usec);
+    perf_long_opt_add("cpus", perf_opt_string, "auto|list",
+                      "pin threads to these CPUs (e.g. 2-5,8), or with auto to the "
+                      "NUMA-local ones outside the RPS cpuset",
+                      NULL, &cpus);
+    perf_long_opt_add("udp-gro", perf_opt_boolean, NULL,
+                      "let the kernel coalesce responses with UDP GRO (UDP only)",
+                      NULL, &config->udp_gro);
+    perf_long_opt_add("xdp-dev", perf_opt_string, "interface",
+                      "the interface to bind with -m udp-xdp",
+                      NULL, &config->xdp.ifname);
+    perf_long_opt_add("xdp-queue", perf_opt_uint, "queue",
+                      "the first receive queue to bind with -m udp-xdp, one per thread",
+                      "0", &config->xdp.queue);
+    perf_long_opt_add("xdp-native", perf_opt_boolean, NULL,
+                      "attach XDP in driver mode and try zero-copy",
+                      NULL, &config->xdp.native);
+    perf_long_opt_add("xdp-dmac", perf_opt_string, "mac",
+                      "the next hop MAC for -m udp-xdp, default: look up the server",
+                      NULL, &config->xdp.dmac);
+    perf_long_opt_add("incoming-cpu", perf_opt_boolean, NULL,
+                      "count responses and their latency by the CPU the kernel "
+                      "processed them on (SO_INCOMING_CPU)",
+                      NULL, &config->incoming_cpu);
+    perf_long_opt_add("incoming-cpu-steer", perf_opt_boolean, NULL,
+                      "with incoming-cpu, move each receiver to the CPU most of "
+                      "its responses arrive on",
+                      NULL, &config->incoming_steer);
+    perf_long_opt_add("arrival", perf_opt_string, "model",
+                      "how -Q queries arrive: constant, poisson, "
+                      "onoff[:on_ms[:off_ms]] or mmpp[:ratio[:dwell_ms]]",
+                      "constant", &arrival);
+    perf_long_opt_add("open-loop", perf_opt_boolean, NULL,
+                      "send on the -Q schedule however the server keeps up, and "
+                      "also measure latency from each query's scheduled send time",
+                      NULL, &config->open_loop);
+    perf_long_opt_add("precision", perf_opt_uint, "digits",
+                      "significant digits of the latency histograms (1-4); each histogram "
+                      "takes 38 KB at 2, 280 KB at 3 and 4 MB at 4, and every thread keeps "
+                      "one per latency it reports (interval ones stop at 3)",
+                      stringify(DEFAULT_PRECISION), &config->precision);
+    perf_long_opt_add("kernel-timestamps", perf_opt_boolean, NULL,
+                      "measure latency to the kernel receive timestamp (UDP only)",
+                      NULL, &config->kernel_timestamps);
 
     perf_opt_parse(argc, argv);
 
+    /* Options are given in microseconds, timestamps are nanoseconds. */
+    config->timeout *= 1000;
+    config->timelimit *= 1000;
+    if (qtype_timeouts != NULL)
+        parse_qtype_timeouts(config, qtype_timeouts);
+    if (port_range != NULL)
+        parse_port_range(config, port_range);
+    if (cpus != NULL)
+        parse_cpus(config, cpus);
+    perf_os_clock_init(config->clock != NULL ? perf_os_clock_parse(config->clock) : perf_os_clock_raw);
+
     if (mode != 0)
-        config->mode = perf_net_parsemode(mode);
+        config->mode = perf_net_parsetransport(mode, &config->net_flags);
+    if (config->uring_sqpoll)
+        config->net_flags |= PERF_NET_URING_SQPOLL;
+    if (config->busy_poll_usec > 0)
+        config->busy_poll = true;
+    if (config->precision < 1 || config->precision > PERF_HIST_MAX_DIGITS)
+        perf_log_fatal("precision must be 1 to %d digits", PERF_HIST_MAX_DIGITS);
+    if (config->incoming_steer)
+        config->incoming_cpu = true;
+    if (config->open_loop && config->max_qps == 0)
+        perf_log_fatal("-O open-loop needs a schedule, set with -Q");
+    if (arrival != NULL)
+    {
+        if (config->max_qps == 0)
+            perf_log_fatal("-O arrival needs a rate, set with -Q");
+        if (perf_arrival_parse(arrival, &config->arrival) < 0)
+            perf_log_fatal("invalid arrival model: %s", arrival);
+    }
+    if (engine != NULL)
+    {
+        if (strcmp(engine, "rtc") == 0 || strcmp(engine, "run-to-completion") == 0)
+            config->rtc = true;
+        else if (strcmp(engine, "split") != 0)
+            perf_log_fatal("invalid engine: %s", engine);
+    }
 
     if (!server_port)
     {
@@ -674,8 +1585,17 @@ setup(int argc, char **argv, config_t *config)
     perf_net_parseserver(config->family, server_name, server_port,
                          &config->server_addr);
 
-    perf_net_parselocal(isc_sockaddr_pf(&config->server_addr),
-                        local_name, local_port, &config->local_addr);
+    config->nlocal = perf_net_parselocals(isc_sockaddr_pf(&config->server_addr),
+                                          local_name, local_port, &config->local_addrs);
+    config->local_addr = config->local_addrs[0];
+    if (config->nlocal > config->clients)
+    {
+        /* A port range fixes the number of clients. */
+        if (config->port_last != 0)
+            perf_log_fatal("port range %u-%u has fewer ports than the %u local addresses",
+                           config->port_first, config->port_last, config->nlocal);
+        config->clients = config->nlocal;
+    }
 
     input = perf_datafile_open(mctx, filename);
 
@@ -683,6 +1603,45 @@ setup(int argc, char **argv, config_t *config)
         config->maxruns = 1;
     perf_datafile_setmaxruns(input, config->maxruns);
 
+    if (config->recv_batch > PERF_NET_MAX_BATCH)
+        config->recv_batch = PERF_NET_MAX_BATCH;
+    if (config->send_batch > PERF_NET_MAX_BATCH)
+        config->send_batch = PERF_NET_MAX_BATCH;
+    if (config->net_flags & PERF_NET_XDP)
+    {
+        if (config->mode != sock_udp)
+            perf_log_fatal("AF_XDP is only supported for UDP");
+        if (config->xdp.ifname == NULL)
+            perf_log_fatal("-m udp-xdp needs an interface, set -O xdp-dev");
+        if (config->nlocal > 1)
+            perf_log_fatal("AF_XDP sends from a single local address");
+        if (config->incoming_cpu)
+            perf_log_fatal("AF_XDP responses bypass the socket, -O incoming-cpu does not apply");
+    }
+    if (config->kernel_timestamps && (config->mode != sock_udp || (config->net_flags & (PERF_NET_URING | PERF_NET_XDP))))
+    {
+        perf_log_warning("kernel timestamps are only supported for UDP sockets, measuring in userspace");
+        config->kernel_timestamps = false;
+    }
+    if (config->udp_gro && (config->mode != sock_udp || (config->net_flags & (PERF_NET_URING | PERF_NET_XDP))))
+    {
+        perf_log_warning("UDP GRO is only supported for UDP sockets, receiving without it");
+        config->udp_gro = false;
+    }
+    if (config->send_batch > 1 && config->mode != sock_udp)
+    {
+        perf_log_warning("send-batch is only supported for UDP, sending one query at a time");
+        config->send_batch = 1;
+    }
+    if (config->net_flags & PERF_NET_GSO)
+    {
+        if (config->mode != sock_udp)
+            perf_log_fatal("GSO is only supported for UDP");
+        /* GSO works on batches; without -O send-batch use full ones. */
+        if (config->send_batch == DEFAULT_SEND_BATCH)
+            config->send_batch = DEFAULT_GSO_BATCH;
+    }
+
     if (config->dnssec || edns_option != NULL)
         config->edns = true;
 
@@ -704,6 +1663,11 @@ setup(int argc, char **argv, config_t *config)
      */
     if (config->threads > config->clients)
         config->threads = config->clients;
+
+    nfds = fds_needed(config);
+    if ((config->port_last != 0 || config->nlocal > 1) && perf_os_fdlimit(nfds) < nfds)
+        perf_log_fatal("%u clients need %u open files, raise the limit (ulimit -n)",
+                       config->clients, nfds);
 }
 
 static void
@@ -722,174 +1686,590 @@ cleanup(config_t *config)
         perf_dns_destroytsigkey(&config->tsigkey);
     if (config->edns_option != NULL)
         perf_dns_destroyednsoption(&config->edns_option);
+    free(config->local_addrs);
+    free(config->cpus);
     isc_mem_destroy(&mctx);
 }
 
-typedef enum
+/*
+ * Take an outstanding query; fails if the other side got it first.
+ */
+static inline bool
+query_claim(query_info *q)
+{
+    uint32_t expected = QUERY_OUTSTANDING;
+
+    return __atomic_compare_exchange_n(&q->state, &expected, QUERY_FREE, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The counters of the local address a socket of the thread is bound to.
+ */
+static inline source_stats_t *
+source_of(threadinfo_t *tinfo, const struct perf_net_socket *sock)
 {
-    prepend_unused,
-    append_unused,
-    prepend_outstanding,
-} query_move_op;
+    return &tinfo->sources[(sock - tinfo->socks + tinfo->socket_offset) %
+                           tinfo->config->nlocal];
+}
 
+/*
+ * Receiver side: queue a retired query's ID for the sender.  Nothing is
+ * visible to the sender until qid_publish().
+ */
 static inline void
-query_move(threadinfo_t *tinfo, query_info *q, query_move_op op)
+qid_put(threadinfo_t *tinfo, query_info *q)
 {
-    ISC_LIST_UNLINK(*q->list, q, link);
-    switch (op)
-    {
-    case prepend_unused:
-        q->list = &tinfo->unused_queries;
-        ISC_LIST_PREPEND(tinfo->unused_queries, q, link);
-        break;
-    case append_unused:
-        q->list = &tinfo->unused_queries;
-        ISC_LIST_APPEND(tinfo->unused_queries, q, link);
-        break;
-    case prepend_outstanding:
-        q->list = &tinfo->outstanding_queries;
-        ISC_LIST_PREPEND(tinfo->outstanding_queries, q, link);
-        break;
-    }
+    qid_ring_t *ring = &tinfo->free_ids;
+
+    ring->ids[ring->next++ & (NQIDS - 1)] = q - tinfo->queries;
 }
 
-static inline uint64_t
-num_outstanding(const stats_t *stats)
+static void
+wake_sender(threadinfo_t *tinfo)
 {
-    return stats->num_sent - stats->num_completed - stats->num_timedout;
+    __atomic_add_fetch(&tinfo->free_ids.wake, 1, __ATOMIC_SEQ_CST);
+    perf_os_wake(&tinfo->free_ids.wake);
 }
 
 static void
-wait_for_start(void)
+qid_publish(threadinfo_t *tinfo)
 {
-    LOCK(&start_lock);
-    while (!started)
-        WAIT(&start_cond, &start_lock);
-    UNLOCK(&start_lock);
+    qid_ring_t *ring = &tinfo->free_ids;
+
+    if (ring->next == ring->tail)
+        return;
+    __atomic_store_n(&ring->tail, ring->next, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED))
+        wake_sender(tinfo);
 }
 
-static void *
-do_send(void *arg)
+/*
+ * Sender side: the number of IDs the receiver has handed back.
+ */
+static inline uint32_t
+qid_available(threadinfo_t *tinfo)
 {
-    threadinfo_t *tinfo;
-    const config_t *config;
-    const times_t *times;
-    stats_t *stats;
-    unsigned int max_packet_size;
-    isc_buffer_t msg;
-    uint64_t now, run_time, req_time;
-    char input_data[MAX_INPUT_DATA];
-    isc_buffer_t lines;
-    isc_region_t used;
-    query_info *q;
-    int qid;
-    unsigned char packet_buffer[MAX_EDNS_PACKET];
-    unsigned char *base;
-    unsigned int length;
-    int n, i, any_inprogress = 0;
-    isc_result_t result;
+    return __atomic_load_n(&tinfo->free_ids.tail, __ATOMIC_ACQUIRE) - tinfo->free_ids.head;
+}
 
-    tinfo = (threadinfo_t *)arg;
-    config = tinfo->config;
-    times = tinfo->times;
-    stats = &tinfo->stats;
-    max_packet_size = config->edns ? MAX_EDNS_PACKET : MAX_UDP_PACKET;
-    isc_buffer_init(&msg, packet_buffer, max_packet_size);
-    isc_buffer_init(&lines, input_data, sizeof(input_data));
+static unsigned int
+qid_take(threadinfo_t *tinfo, query_info **batch, unsigned int n)
+{
+    qid_ring_t *ring = &tinfo->free_ids;
+    uint32_t avail;
+    unsigned int k;
+
+    avail = qid_available(tinfo);
+    if (n > avail)
+        n = avail;
+    for (k = 0; k < n; k++)
+        batch[k] = &tinfo->queries[ring->ids[(ring->head + k) & (NQIDS - 1)]];
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+    return n;
+}
 
-    wait_for_start();
-    now = get_time();
-    while (!interrupted && now < times->stop_time)
+/*
+ * Sender side: sleep until the receiver hands back more IDs than the
+ * avail we last saw, or until the end of the run.
+ */
+static void
+qid_wait(threadinfo_t *tinfo, uint32_t avail)
+{
+    qid_ring_t *ring = &tinfo->free_ids;
+    uint32_t wake;
+
+    wake = __atomic_load_n(&ring->wake, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (qid_available(tinfo) == avail && !interrupted)
+        perf_os_wait(&ring->wake, wake, &tinfo->times->stop_time_ns);
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * The timeout for a query line, "name type", from -O qtype-timeout.
+ */
+static uint64_t
+query_timeout(const config_t *config, const isc_region_t *line)
+{
+    const char *p = (const char *)line->base;
+    const char *end = p + line->length;
+    size_t len;
+    unsigned int i;
+
+    if (config->nqtype_timeouts == 0 || config->updates)
+        return config->timeout;
+
+    while (p < end && strchr(WHITESPACE, *p) == NULL)
+        p++;
+    while (p < end && *p != 0 && strchr(WHITESPACE, *p) != NULL)
+        p++;
+    for (len = 0; p + len < end && p[len] != 0 && strchr(WHITESPACE, p[len]) == NULL; len++)
+        ;
+    for (i = 0; i < config->nqtype_timeouts; i++)
     {
-        /* Avoid flooding the network too quickly. */
-        if (stats->num_sent < tinfo->max_outstanding && stats->num_sent % 2 == 1)
-        {
-            if (stats->num_completed == 0)
-                usleep(1000);
-            else
-                sleep(0);
-            now = get_time();
-        }
+        if (strlen(config->qtype_timeouts[i].qtype) == len &&
+            strncasecmp(config->qtype_timeouts[i].qtype, p, len) == 0)
+            return config->qtype_timeouts[i].timeout;
+    }
+    return config->timeout;
+}
 
-        /* Rate limiting */
-        if (tinfo->max_qps > 0)
-        {
-            run_time = now - times->start_time;
-            req_time = (MILLION * stats->num_sent) / tinfo->max_qps;
-            if (req_time > run_time)
-            {
-                usleep(req_time - run_time);
-                now = get_time();
-                continue;
-            }
-        }
+static void
+wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+    unsigned int i;
+
+    wheel->now_tick = now / WHEEL_TICK;
+    for (i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+        wheel->buckets[i] = TIMER_NIL;
+    for (i = 0; i < NQIDS; i++)
+        wheel->timers[i].linked = false;
+}
 
-        LOCK(&tinfo->lock);
+static void
+wheel_link(timer_wheel_t *wheel, uint32_t qid)
+{
+    query_timer_t *t = &wheel->timers[qid];
+    uint64_t tick, delta;
+    unsigned int level;
 
-        /* Limit in-flight queries */
-        if (num_outstanding(stats) >= tinfo->max_outstanding)
-        {
-            TIMEDWAIT(&tinfo->cond, &tinfo->lock, &times->stop_time_ns, NULL);
-            UNLOCK(&tinfo->lock);
-            now = get_time();
-            continue;
-        }
+    tick = t->tick < wheel->now_tick ? wheel->now_tick : t->tick;
+    delta = tick - wheel->now_tick;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+            break;
+    }
+    if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+        tick = wheel->now_tick + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    t->bucket = level * WHEEL_SIZE + ((tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    t->prev = TIMER_NIL;
+    t->next = wheel->buckets[t->bucket];
+    if (t->next != TIMER_NIL)
+        wheel->timers[t->next].prev = qid;
+    wheel->buckets[t->bucket] = qid;
+    t->linked = true;
+}
+
+static void
+wheel_unlink(timer_wheel_t *wheel, uint32_t qid)
+{
+    query_timer_t *t = &wheel->timers[qid];
+
+    if (!t->linked)
+        return;
+    if (t->prev != TIMER_NIL)
+        wheel->timers[t->prev].next = t->next;
+    else
+        wheel->buckets[t->bucket] = t->next;
+    if (t->next != TIMER_NIL)
+        wheel->timers[t->next].prev = t->prev;
+    t->linked = false;
+}
+
+static void
+wheel_add(timer_wheel_t *wheel, uint32_t qid, uint32_t gen, uint64_t deadline)
+{
+    query_timer_t *t = &wheel->timers[qid];
 
-        q = ISC_LIST_HEAD(tinfo->unused_queries);
-        query_move(tinfo, q, prepend_outstanding);
-        q->timestamp = ISC_UINT64_MAX;
+    wheel_unlink(wheel, qid);
+    t->tick = (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+    t->gen = gen;
+    wheel_link(wheel, qid);
+}
+
+/*
+ * Run the wheel up to now.  Returns the expired timers chained through
+ * their next fields, or TIMER_NIL.
+ */
+static uint32_t
+wheel_advance(timer_wheel_t *wheel, uint64_t now)
+{
+    uint64_t target = now / WHEEL_TICK;
+    uint32_t expired = TIMER_NIL, qid, next;
+    unsigned int level, idx, bucket;
 
-        i = tinfo->nsocks * 2;
-        while (i--)
+    for (; wheel->now_tick <= target; wheel->now_tick++)
+    {
+        if ((wheel->now_tick & WHEEL_MASK) == 0)
         {
-            q->sock = &tinfo->socks[tinfo->current_sock++ % tinfo->nsocks];
-            switch (perf_net_sockready(q->sock, threadpipe[0], TIMEOUT_CHECK_TIME))
+            for (level = 1; level < WHEEL_LEVELS; level++)
             {
-            case 0:
-                if (config->verbose)
-                {
-                    perf_log_warning("socket %p not ready", q->sock);
-                }
-                q->sock = 0;
-                continue;
-            case -1:
-                if (errno == EINPROGRESS)
-                {
-                    any_inprogress = 1;
-                    q->sock = 0;
-                    continue;
-                }
-                if (config->verbose)
+                idx = (wheel->now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                bucket = level * WHEEL_SIZE + idx;
+                qid = wheel->buckets[bucket];
+                wheel->buckets[bucket] = TIMER_NIL;
+                for (; qid != TIMER_NIL; qid = next)
                 {
-                    perf_log_warning("socket %p readiness check timed out", q->sock);
+                    next = wheel->timers[qid].next;
+                    wheel_link(wheel, qid);
                 }
-            default:
-                break;
+                if (idx != 0)
+                    break;
             }
-            break;
-        };
+        }
 
-        if (!q->sock)
+        bucket = wheel->now_tick & WHEEL_MASK;
+        qid = wheel->buckets[bucket];
+        wheel->buckets[bucket] = TIMER_NIL;
+        for (; qid != TIMER_NIL; qid = next)
         {
-            query_move(tinfo, q, prepend_unused);
-            UNLOCK(&tinfo->lock);
-            now = get_time();
-            continue;
+            next = wheel->timers[qid].next;
+            wheel->timers[qid].linked = false;
+            wheel->timers[qid].next = expired;
+            expired = qid;
         }
-        UNLOCK(&tinfo->lock);
+    }
+    return expired;
+}
 
-        isc_buffer_clear(&lines);
-        result = perf_datafile_next(input, &lines, config->updates);
+/*
+ * Sender side: publish the queries of a batch that went out.
+ */
+static void
+push_sent(threadinfo_t *tinfo, query_info **batch, unsigned int n)
+{
+    sent_record_t *rec;
+    uint32_t tail;
+    unsigned int k;
+
+    tail = tinfo->sent_tail;
+    for (k = 0; k < n; k++)
+    {
+        while (tail - __atomic_load_n(&tinfo->sent_head, __ATOMIC_ACQUIRE) >= NQIDS)
+            sched_yield();
+        rec = &tinfo->sent[tail & (NQIDS - 1)];
+        rec->qid = batch[k] - tinfo->queries;
+        rec->gen = batch[k]->gen;
+        rec->deadline = batch[k]->timestamp + batch[k]->timeout;
+        tail++;
+    }
+    __atomic_store_n(&tinfo->sent_tail, tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Receiver side: file everything the sender published.
+ */
+static void
+drain_sent(threadinfo_t *tinfo)
+{
+    sent_record_t *rec;
+    uint32_t head, tail;
+
+    head = tinfo->sent_head;
+    tail = __atomic_load_n(&tinfo->sent_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        rec = &tinfo->sent[head & (NQIDS - 1)];
+        wheel_add(tinfo->wheel, rec->qid, rec->gen, rec->deadline);
+    }
+    __atomic_store_n(&tinfo->sent_head, head, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t
+num_outstanding(const threadinfo_t *tinfo)
+{
+    return __atomic_load_n(&tinfo->send_stats.num_sent, __ATOMIC_RELAXED) -
+           tinfo->recv_stats.num_completed - tinfo->recv_stats.num_timedout;
+}
+
+static void
+wait_for_start(void)
+{
+    LOCK(&start_lock);
+    while (!started)
+        WAIT(&start_cond, &start_lock);
+    UNLOCK(&start_lock);
+}
+
+/*
+ * Sender state: queries of one batch are built into a per-sender packet
+ * arena and handed to the socket together.
+ */
+typedef struct
+{
+    unsigned int max_packet_size;
+    unsigned int nbatch;
+    unsigned char *arena;
+    struct perf_net_packet *pkts;
+    query_info **batch;
+    /*
+     * Slots the sender takes back (build or send failures, end of
+     * input) are kept here and used first; the ring only flows from the
+     * receiver to the sender.
+     */
+    query_info **spare;
+    unsigned int nspare;
+    char input_data[MAX_INPUT_DATA];
+    isc_buffer_t lines;
+    int any_inprogress;
+    bool done;
+} sender_t;
+
+static void
+sender_init(threadinfo_t *tinfo, sender_t *s)
+{
+    const config_t *config = tinfo->config;
+
+    memset(s, 0, sizeof(*s));
+    s->max_packet_size = config->edns ? MAX_EDNS_PACKET : MAX_UDP_PACKET;
+    isc_buffer_init(&s->lines, s->input_data, sizeof(s->input_data));
+
+    s->nbatch = config->send_batch;
+    s->arena = malloc(s->nbatch * s->max_packet_size);
+    s->pkts = calloc(s->nbatch, sizeof(*s->pkts));
+    s->batch = calloc(s->nbatch, sizeof(*s->batch));
+    s->spare = calloc(s->nbatch, sizeof(*s->spare));
+    if (s->arena == NULL || s->pkts == NULL || s->batch == NULL || s->spare == NULL)
+        perf_log_fatal("out of memory");
+    if (tinfo->arrival != NULL)
+        perf_os_pace_init();
+}
+
+/*
+ * With -Q, the time into the run at which query n of a thread is due,
+ * in ns, from the thread's arrival process.
+ */
+static inline uint64_t
+scheduled(threadinfo_t *tinfo, uint64_t n)
+{
+    return perf_arrival_at(tinfo->arrival, n);
+}
+
+/*
+ * Wait for sockets still connecting or flushing, count what the -Q
+ * schedule had due but was never sent, then report the end of sending.
+ */
+static void
+sender_finish(threadinfo_t *tinfo, sender_t *s)
+{
+    send_stats_t *stats = &tinfo->send_stats;
+    uint64_t end, unsent;
+    bool estimated;
+    int i;
+
+    while (s->any_inprogress)
+    {
+        s->any_inprogress = 0;
+        for (i = 0; i < tinfo->nsocks; i++)
+        {
+            if (perf_net_sockready(&tinfo->socks[i], threadpipe[0], TIMEOUT_CHECK_TIME) == -1 && errno == EINPROGRESS)
+            {
+                s->any_inprogress = 1;
+            }
+        }
+    }
+
+    free(s->spare);
+    free(s->batch);
+    free(s->pkts);
+    free(s->arena);
+
+    tinfo->done_send_time = perf_os_clock_now();
+
+    /*
+     * When the run is cut short by the time limit or an interrupt, the
+     * -Q schedule may have had queries due that never went out; they
+     * count against the schedule as much as late ones do.
+     */
+    if (tinfo->arrival != NULL && !s->done)
+    {
+        end = tinfo->done_send_time < tinfo->times->stop_time ? tinfo->done_send_time : tinfo->times->stop_time;
+        end -= tinfo->times->start_time;
+        unsent = perf_arrival_count(tinfo->arrival, stats->num_sent, end, &estimated);
+        stats_write_begin(&stats->seq);
+        stats->num_unsent = unsent;
+        stats->unsent_estimated = estimated;
+        stats_write_end(&stats->seq);
+    }
+
+    tinfo->done_sending = true;
+    if (write(mainpipe[1], "", 1))
+    { // lgtm [cpp/empty-block]
+    }
+}
+
+/*
+ * One round of the sender: reserve, build and send up to a batch of
+ * queries.  With block set it sleeps wherever it has to hold back, as
+ * the sender thread does; without, it returns instead, with the time
+ * at which it is worth trying again, or ISC_UINT64_MAX when that
+ * depends on responses.  It returns 0 when it can go on at once.
+ */
+static uint64_t
+send_round(threadinfo_t *tinfo, sender_t *s, uint64_t *nowp, bool block)
+{
+    const config_t *config;
+    const times_t *times;
+    send_stats_t *stats;
+    isc_buffer_t msg;
+    uint64_t now, run_time, req_time, allowed, lag;
+    isc_region_t used;
+    query_info *q, **batch, **spare;
+    struct perf_net_socket *sock;
+    struct perf_net_packet *pkts;
+    int qid;
+    unsigned int nreserved, nbuilt, room, k;
+    uint32_t avail, inflight;
+    int n, i;
+    isc_result_t result;
+
+    config = tinfo->config;
+    times = tinfo->times;
+    stats = &tinfo->send_stats;
+    batch = s->batch;
+    spare = s->spare;
+    pkts = s->pkts;
+    now = *nowp;
+
+    /* Avoid flooding the network too quickly, unless on a schedule. */
+    nreserved = s->nbatch;
+    if (stats->num_sent < tinfo->max_outstanding && !config->open_loop)
+    {
+        nreserved = 1;
+        if (stats->num_sent % 2 == 1 && block)
+        {
+            if (__atomic_load_n(&tinfo->recv_stats.num_completed, __ATOMIC_RELAXED) == 0)
+                usleep(1000);
+            else
+                sleep(0);
+            now = *nowp = perf_os_clock_now();
+        }
+    }
+
+    /* Rate limiting */
+    if (tinfo->max_qps > 0)
+    {
+        run_time = now - times->start_time;
+        req_time = scheduled(tinfo, stats->num_sent);
+        if (req_time > run_time)
+        {
+            if (!block)
+                return times->start_time + req_time;
+            perf_os_sleepuntil(times->start_time + req_time);
+            *nowp = perf_os_clock_now();
+            return 0;
+        }
+        for (allowed = 1; allowed < nreserved; allowed++)
+        {
+            if (scheduled(tinfo, stats->num_sent + allowed) > run_time)
+                break;
+        }
+        nreserved = allowed;
+    }
+
+    /* Limit in-flight queries */
+    avail = qid_available(tinfo);
+    inflight = NQIDS - avail - s->nspare;
+    if (inflight >= tinfo->max_outstanding)
+    {
+        if (!block)
+            return ISC_UINT64_MAX;
+        qid_wait(tinfo, avail);
+        *nowp = perf_os_clock_now();
+        return 0;
+    }
+    if (tinfo->max_outstanding - inflight < nreserved)
+        nreserved = tinfo->max_outstanding - inflight;
+
+    sock = NULL;
+    i = tinfo->nsocks * 2;
+    while (i--)
+    {
+        sock = &tinfo->socks[tinfo->current_sock++ % tinfo->nsocks];
+        switch (perf_net_sockready(sock, threadpipe[0], block ? TIMEOUT_CHECK_TIME : 0))
+        {
+        case 0:
+            if (config->verbose)
+            {
+                perf_log_warning("socket %p not ready", sock);
+            }
+            sock = NULL;
+            continue;
+        case -1:
+            if (errno == EINPROGRESS)
+            {
+                s->any_inprogress = 1;
+                sock = NULL;
+                continue;
+            }
+            if (config->verbose)
+            {
+                perf_log_warning("socket %p readiness check timed out", sock);
+            }
+        default:
+            break;
+        }
+        break;
+    };
+
+    if (sock == NULL)
+    {
+        if (tinfo->uring != NULL)
+        {
+            /* Stream sockets on the ring are busy until their write is reaped. */
+            if (!block)
+                return ISC_UINT64_MAX;
+            perf_net_uring_sendwait(tinfo->uring, TIMEOUT_CHECK_TIME);
+        }
+        *nowp = perf_os_clock_now();
+        return block ? 0 : *nowp + MILLION;
+    }
+
+    /*
+     * The io_uring send slots come free as the receiver reaps earlier
+     * sends; take no more queries than fit, and wait for the receiver
+     * when none do.
+     */
+    if (sock->uring != NULL)
+    {
+        room = perf_net_uring_sendroom(sock->uring, nreserved);
+        if (room == 0)
+        {
+            if (!block)
+                return ISC_UINT64_MAX;
+            perf_net_uring_sendwait(sock->uring, TIMEOUT_CHECK_TIME);
+            *nowp = perf_os_clock_now();
+            return 0;
+        }
+        nreserved = room;
+    }
+
+    /* Reserve the query slots of the batch. */
+    k = nreserved < s->nspare ? nreserved : s->nspare;
+    s->nspare -= k;
+    memcpy(batch, spare + s->nspare, k * sizeof(*batch));
+    nreserved = k + qid_take(tinfo, batch + k, nreserved - k);
+    for (k = 0; k < nreserved; k++)
+    {
+        q = batch[k];
+        q->state = QUERY_RESERVED;
+        q->gen++;
+        q->sock = sock;
+    }
+
+    nbuilt = 0;
+    for (k = 0; k < nreserved; k++)
+    {
+        q = batch[k];
+
+        isc_buffer_clear(&s->lines);
+        result = perf_datafile_next(input, &s->lines, config->updates);
         if (result != ISC_R_SUCCESS)
         {
             if (result == ISC_R_INVALIDFILE)
                 perf_log_fatal("input file contains no data");
+            s->done = true;
             break;
         }
 
         qid = q - tinfo->queries;
-        isc_buffer_usedregion(&lines, &used);
-        isc_buffer_clear(&msg);
+        isc_buffer_usedregion(&s->lines, &used);
+        isc_buffer_init(&msg, s->arena + nbuilt * s->max_packet_size, s->max_packet_size);
         result = perf_dns_buildrequest(tinfo->dnsctx,
                                        (isc_textregion_t *)&used,
                                        qid, config->edns,
@@ -897,24 +2277,22 @@ do_send(void *arg)
                                        config->edns_option, &msg);
         if (result != ISC_R_SUCCESS)
         {
-            LOCK(&tinfo->lock);
-            query_move(tinfo, q, prepend_unused);
-            UNLOCK(&tinfo->lock);
-            now = get_time();
+            q->state = QUERY_FREE;
+            spare[s->nspare++] = q;
             continue;
         }
 
-        base = isc_buffer_base(&msg);
-        length = isc_buffer_usedlength(&msg);
+        pkts[nbuilt].buf = isc_buffer_base(&msg);
+        pkts[nbuilt].len = isc_buffer_usedlength(&msg);
+        q->timeout = query_timeout(config, &used);
+        q->qtype = perf_dns_qtype(pkts[nbuilt].buf, pkts[nbuilt].len);
 
-        now = get_time();
         if (config->verbose)
         {
-            q->desc = strdup(lines.base);
+            q->desc = strdup(s->lines.base);
             if (q->desc == NULL)
                 perf_log_fatal("out of memory");
         }
-        q->timestamp = now;
 
         // 拷贝数据及长度
         if (tinfo->dnsctx == NULL)
@@ -926,84 +2304,135 @@ do_send(void *arg)
             memcpy(q->sock->msg_buf, domain_str, domain_len);
             q->sock->msg_len = strlen(q->sock->msg_buf);
             q->sock->tid = qid;
-            // printf("+928 domain_str=%s, domain_len=%d, msg_len=%d, qid=%d\n", domain_str, domain_len, q->sock->msg_len, q->sock->tid);
         }
 
+        batch[nbuilt++] = q;
+    }
 
-        n = perf_net_sendto(q->sock, base, length, 0, &config->server_addr.type.sa,
-                            config->server_addr.length);
-        if (n < 0)
+    /* Slots left over after end of input go straight back. */
+    for (; k < nreserved; k++)
+    {
+        batch[k]->state = QUERY_FREE;
+        spare[s->nspare++] = batch[k];
+    }
+
+    if (nbuilt == 0)
+    {
+        *nowp = perf_os_clock_now();
+        return 0;
+    }
+
+    /*
+     * Every query of the batch leaves in the same system call, so
+     * they all share one send timestamp.  The queries are handed to
+     * the receiver before the send, as a response can beat the
+     * return from the system call.
+     */
+    now = *nowp = perf_os_clock_now();
+    for (k = 0; k < nbuilt; k++)
+    {
+        batch[k]->timestamp = now;
+        batch[k]->intended = tinfo->arrival != NULL ? times->start_time + scheduled(tinfo, stats->num_sent + k) : now;
+        __atomic_store_n(&batch[k]->state, QUERY_OUTSTANDING, __ATOMIC_RELEASE);
+    }
+
+    n = perf_net_sendmmsg(sock, pkts, nbuilt, 0, &config->server_addr.type.sa,
+                          config->server_addr.length);
+    if (n < 0)
+    {
+        /* The receiver can take the last queue entries of the ring
+         * after perf_net_uring_sendroom(); that is no failure. */
+        if (errno != EAGAIN || sock->uring == NULL)
+            perf_log_warning("failed to send packet: %s", strerror(errno));
+        n = 0;
+    }
+    else if (!sock->is_ready)
+    {
+        if (config->verbose)
         {
-            if (errno == EINPROGRESS)
-            {
-                if (config->verbose)
-                {
-                    perf_log_warning("network congested, packet sending in progress");
-                }
-                any_inprogress = 1;
-            }
-            else
-            {
-                perf_log_warning("failed to send packet: %s", strerror(errno));
-                LOCK(&tinfo->lock);
-                query_move(tinfo, q, prepend_unused);
-                UNLOCK(&tinfo->lock);
-                continue;
-            }
+            perf_log_warning("network congested, packet sending in progress");
         }
-        else if ((unsigned int)n != length)
+        s->any_inprogress = 1;
+    }
+
+    stats_write_begin(&stats->seq);
+    for (k = 0; k < (unsigned int)n; k++)
+    {
+        stats->total_request_size += pkts[k].len;
+        if (tinfo->arrival != NULL)
         {
-            perf_log_warning("failed to send full packet: only sent %d of %u", n, length);
-            LOCK(&tinfo->lock);
-            query_move(tinfo, q, prepend_unused);
-            UNLOCK(&tinfo->lock);
-            continue;
+            lag = now > batch[k]->intended ? now - batch[k]->intended : 0;
+            perf_hist_record(&tinfo->send_lag, lag);
+            if (lag > LATE_THRESHOLD)
+                stats->num_late++;
         }
-        stats->num_sent++;
-
-        stats->total_request_size += length;
     }
+    __atomic_store_n(&stats->num_sent, stats->num_sent + n, __ATOMIC_RELAXED);
+    stats_write_end(&stats->seq);
+    if (tinfo->sources != NULL)
+        source_of(tinfo, sock)->num_sent += n;
+    push_sent(tinfo, batch, n);
 
-    while (any_inprogress)
+    for (k = n; k < nbuilt; k++)
     {
-        any_inprogress = 0;
-        for (i = 0; i < tinfo->nsocks; i++)
+        q = batch[k];
+        if (!query_claim(q))
+            continue;
+        if (q->desc != NULL)
         {
-            if (perf_net_sockready(&tinfo->socks[i], threadpipe[0], TIMEOUT_CHECK_TIME) == -1 && errno == EINPROGRESS)
-            {
-                any_inprogress = 1;
-            }
+            free(q->desc);
+            q->desc = NULL;
         }
+        spare[s->nspare++] = q;
     }
+    return 0;
+}
 
-    tinfo->done_send_time = get_time();
-    tinfo->done_sending = true;
-    if (write(mainpipe[1], "", 1))
-    { // lgtm [cpp/empty-block]
-    }
+static void *
+do_send(void *arg)
+{
+    threadinfo_t *tinfo;
+    sender_t sender;
+    uint64_t now;
+
+    tinfo = (threadinfo_t *)arg;
+    sender_init(tinfo, &sender);
+
+    wait_for_start();
+    now = perf_os_clock_now();
+    while (!sender.done && !interrupted && now < tinfo->times->stop_time)
+        send_round(tinfo, &sender, &now, true);
+
+    sender_finish(tinfo, &sender);
     return NULL;
 }
-
 static void
 process_timeouts(threadinfo_t *tinfo, uint64_t now)
 {
     struct query_info *q;
     const config_t *config;
+    uint32_t expired, next;
+    uint64_t ntimedout;
 
     config = tinfo->config; // 参数配置
 
-    /* Avoid locking unless we need to. */
-    q = ISC_LIST_TAIL(tinfo->outstanding_queries);
-    if (q == NULL || q->timestamp > now || now - q->timestamp < config->timeout)    // 没有超时就返回
+    drain_sent(tinfo);
+    expired = wheel_advance(tinfo->wheel, now);
+    if (expired == TIMER_NIL)    // 没有超时就返回
         return;
 
-    LOCK(&tinfo->lock);
-
-    do
+    ntimedout = 0;
+    for (; expired != TIMER_NIL; expired = next)
     {
-        query_move(tinfo, q, append_unused);
+        next = tinfo->wheel->timers[expired].next;
+        q = &tinfo->queries[expired];
+        if (__atomic_load_n(&q->state, __ATOMIC_ACQUIRE) != QUERY_OUTSTANDING ||
+            q->gen != tinfo->wheel->timers[expired].gen || !query_claim(q))
+            continue;
 
-        tinfo->stats.num_timedout++;
+        ntimedout++;
+        if (tinfo->sources != NULL)
+            source_of(tinfo, q->sock)->num_timedout++;
 
         if (q->desc != NULL)
         {
@@ -1013,8 +2442,9 @@ process_timeouts(threadinfo_t *tinfo, uint64_t now)
         {
             // 报错信息：增加时间,socket port,name
             char cur_time[128] = {0};   // yyyy-mm-dd HH-MM-SS
-            uint32_t milli_sec = (unsigned int)(now % MILLION) / 1000; // milliseconds
-            time_t tt = now / MILLION;
+            uint64_t wall = perf_os_clock_towall(now);
+            uint32_t milli_sec = (unsigned int)(wall % BILLION) / MILLION; // milliseconds
+            time_t tt = wall / BILLION;
             struct tm *ttime = localtime(&tt);
             strftime(cur_time, 128, "%Y-%m-%d %H:%M:%S", ttime);
             sprintf(cur_time, "%s.%03u", cur_time, milli_sec);
@@ -1042,10 +2472,13 @@ process_timeouts(threadinfo_t *tinfo, uint64_t now)
                             q->sock->tid);
             printf("\n");
         }
-        q = ISC_LIST_TAIL(tinfo->outstanding_queries);
-    } while (q != NULL && q->timestamp < now && now - q->timestamp >= config->timeout);
+        qid_put(tinfo, q);
+    }
 
-    UNLOCK(&tinfo->lock);
+    stats_write_begin(&tinfo->recv_stats.seq);
+    tinfo->recv_stats.num_timedout += ntimedout;
+    stats_write_end(&tinfo->recv_stats.seq);
+    qid_publish(tinfo);
 }
 
 typedef struct
@@ -1053,88 +2486,516 @@ typedef struct
     struct perf_net_socket *sock;
     uint16_t qid;
     uint16_t rcode;
+    uint16_t qtype;
     unsigned int size;
     uint64_t when;
+    uint64_t when_user;
     uint64_t sent;
+    uint64_t intended;
+    uint64_t latency;
     bool unexpected;
     bool short_response;
+    int cpu; /* SO_INCOMING_CPU, -1 if not asked or unknown */
     char *desc;
 } received_query_t;
 
-static bool
-recv_one(threadinfo_t *tinfo, int which_sock,
-         unsigned char *packet_buffer, unsigned int packet_size,
-         received_query_t *recvd, int *saved_errnop)
+static inline void
+fill_received(received_query_t *recvd, struct perf_net_socket *sock,
+              const struct perf_net_packet *pkt, uint64_t now)
 {
     uint16_t *packet_header;
+
+    packet_header = (uint16_t *)pkt->buf;
+    recvd->sock = sock;
+    recvd->qid = ntohs(packet_header[0]);
+    recvd->rcode = ntohs(packet_header[1]) & 0xF;
+    recvd->size = pkt->len;
+    recvd->when = pkt->rx_time != 0 ? pkt->rx_time : now;
+    recvd->when_user = now;
+    recvd->sent = 0;
+    recvd->unexpected = false;
+    recvd->short_response = (pkt->len < 4);
+    recvd->cpu = -1;
+    recvd->qtype = 0;
+    recvd->desc = NULL;
+}
+
+static unsigned int
+recv_batch(threadinfo_t *tinfo, int which_sock,
+           struct perf_net_packet *pkts, unsigned int npkts,
+           received_query_t *recvd, int *saved_errnop)
+{
     uint64_t now;
+    unsigned int i;
+    int n, cpu;
+
+    for (i = 0; i < npkts; i++)
+        pkts[i].len = MAX_EDNS_PACKET;
+
+    n = perf_net_recvmmsg(&tinfo->socks[which_sock], pkts, npkts, 0);
+    now = perf_os_clock_now();
+    if (n < 0)
+    {
+        *saved_errnop = errno;
+        return 0;
+    }
+    for (i = 0; i < (unsigned int)n; i++)
+        fill_received(&recvd[i], &tinfo->socks[which_sock], &pkts[i], now);
+
+    /* The socket only tells the CPU of its last packet; the batch was
+     * most likely all processed there. */
+    if (tinfo->incoming != NULL && n > 0)
+    {
+        cpu = perf_net_incomingcpu(&tinfo->socks[which_sock]);
+        for (i = 0; i < (unsigned int)n; i++)
+            recvd[i].cpu = cpu;
+    }
+    return n;
+}
+
+/*
+ * Reap whatever the thread's io_uring has completed, for all of its
+ * sockets at once.
+ */
+static unsigned int
+recv_uring(threadinfo_t *tinfo, struct perf_net_packet *pkts,
+           unsigned int *which, unsigned int npkts,
+           received_query_t *recvd, int *saved_errnop)
+{
+    uint64_t now;
+    unsigned int i;
+    int n, cpu;
+
+    for (i = 0; i < npkts; i++)
+        pkts[i].len = MAX_EDNS_PACKET;
+
+    n = perf_net_uring_recv(tinfo->uring, pkts, which, npkts);
+    now = perf_os_clock_now();
+    if (n < 0)
+    {
+        *saved_errnop = errno;
+        return 0;
+    }
+    cpu = -1;
+    for (i = 0; i < (unsigned int)n; i++)
+    {
+        fill_received(&recvd[i], &tinfo->socks[which[i]], &pkts[i], now);
+        if (tinfo->incoming == NULL)
+            continue;
+        if (i == 0 || which[i] != which[i - 1])
+            cpu = perf_net_incomingcpu(&tinfo->socks[which[i]]);
+        recvd[i].cpu = cpu;
+    }
+    return n;
+}
+
+/*
+ * Read whatever the thread's AF_XDP RX ring holds, for all of its
+ * sockets at once.
+ */
+static unsigned int
+recv_xdp(threadinfo_t *tinfo, struct perf_net_packet *pkts,
+         unsigned int *which, unsigned int npkts,
+         received_query_t *recvd, int *saved_errnop)
+{
+    uint64_t now;
+    unsigned int i;
     int n;
 
-    packet_header = (uint16_t *)packet_buffer;
+    for (i = 0; i < npkts; i++)
+        pkts[i].len = MAX_EDNS_PACKET;
+
+    n = perf_net_xdp_recv(tinfo->xdp, pkts, which, npkts);
+    now = perf_os_clock_now();
+    if (n < 0)
+    {
+        *saved_errnop = errno;
+        return 0;
+    }
+    for (i = 0; i < (unsigned int)n; i++)
+        fill_received(&recvd[i], &tinfo->socks[which[i]], &pkts[i], now);
+    return n;
+}
+
+static void
+record_breakdown(threadinfo_t *tinfo, const received_query_t *recvd, uint64_t latency)
+{
+    breakdown_t *b = &tinfo->breakdown;
+    struct perf_hist *h;
+
+    if (b->rcode[recvd->rcode] == NULL)
+    {
+        b->rcode[recvd->rcode] = malloc(sizeof(*b->rcode[recvd->rcode]));
+        if (b->rcode[recvd->rcode] == NULL ||
+            perf_hist_init(b->rcode[recvd->rcode], tinfo->config->precision) < 0)
+            perf_log_fatal("out of memory");
+    }
+    perf_hist_record(b->rcode[recvd->rcode], latency);
+    if ((h = breakdown_qtype(tinfo->config, b, recvd->qtype)) != NULL)
+        perf_hist_record(h, latency);
+}
+
+/*
+ * With -O incoming-cpu-steer, move the receiving thread to the CPU most
+ * of its responses have been processed on, so they are read where they
+ * are still in cache.  Looked at again every STEER_INTERVAL responses.
+ */
+#define STEER_INTERVAL 4096
+
+static void
+steer_receiver(threadinfo_t *tinfo)
+{
+    int cpu, best;
+
+    tinfo->steer_next = tinfo->recv_stats.num_completed + STEER_INTERVAL;
+    best = -1;
+    for (cpu = 0; cpu < PERF_OS_MAX_CPUS; cpu++)
+    {
+        if (tinfo->incoming[cpu].num_completed > 0 &&
+            (best < 0 || tinfo->incoming[cpu].num_completed > tinfo->incoming[best].num_completed))
+            best = cpu;
+    }
+    if (best < 0 || best == tinfo->cpu)
+        return;
+    if (perf_os_pincpu(pthread_self(), best) >= 0)
+        tinfo->cpu = best;
+}
+
+/*
+ * Receiver state: one packet arena, carved into MAX_EDNS_PACKET sized
+ * slots so a whole batch can be read before any of it is processed.
+ */
+typedef struct
+{
+    unsigned int depth;
+    unsigned char *arena;
+    struct perf_net_packet *pkts;
+    received_query_t *recvd;
+    unsigned int *which;
+    unsigned int last_slot;
+    uint64_t last_poll; /* with busy polling */
+    bool more; /* the last round may have left data behind */
+} receiver_t;
+
+static void
+receiver_init(threadinfo_t *tinfo, receiver_t *r)
+{
+    unsigned int i;
+
+    memset(r, 0, sizeof(*r));
+    r->depth = tinfo->config->recv_batch;
+    r->arena = malloc(r->depth * MAX_EDNS_PACKET);
+    r->pkts = calloc(r->depth, sizeof(*r->pkts));
+    r->recvd = calloc(r->depth, sizeof(*r->recvd));
+    r->which = calloc(r->depth, sizeof(*r->which));
+    if (r->arena == NULL || r->pkts == NULL || r->recvd == NULL || r->which == NULL)
+        perf_log_fatal("out of memory");
+    for (i = 0; i < r->depth; i++)
+        r->pkts[i].buf = r->arena + i * MAX_EDNS_PACKET;
+}
+
+static void
+receiver_cleanup(receiver_t *r)
+{
+    free(r->which);
+    free(r->recvd);
+    free(r->pkts);
+    free(r->arena);
+}
+
+/*
+ * One round of the receiver: read up to a batch of responses and
+ * account for them.  Returns the number of responses read.
+ */
+static unsigned int
+recv_round(threadinfo_t *tinfo, receiver_t *r, uint64_t *nowp)
+{
+    recv_stats_t *stats;
+    struct perf_net_packet *pkts;
+    received_query_t *recvd;
+    unsigned int depth, nrecvd, want;
+    int saved_errno;
+    uint64_t latency, user_latency;
+    query_info *q;
+    source_stats_t *source;
+    cpu_stats_t *incoming;
+    struct perf_hist *interval;
+    struct perf_capture_rec rec;
+    unsigned int current_socket, slot, nready, nidle;
+    unsigned int i, j;
+    uint32_t gen = 0;
+
+    stats = &tinfo->recv_stats;
+    depth = r->depth;
+    pkts = r->pkts;
+    recvd = r->recvd;
+    interval = NULL;
+    if (tinfo->config->stats_interval > 0)
+    {
+        gen = __atomic_load_n(&tinfo->interval_gen, __ATOMIC_ACQUIRE);
+        interval = &tinfo->interval[gen & 1];
+    }
+
+    /*
+     * Try to receive a few packets, so that we can process them
+     * atomically.  Only sockets the poller reported readable are
+     * read, each with one batched read; a short read means the
+     * socket is drained until the poller reports it again.
+     */
+    saved_errno = 0;
+    nrecvd = 0;
+    nidle = 0;
+    if (tinfo->uring != NULL || tinfo->xdp != NULL)
+        nready = 0;
+    else
+        nready = tinfo->poller.nready;
+    if (tinfo->uring != NULL)
+        nrecvd = recv_uring(tinfo, pkts, r->which, depth, recvd, &saved_errno);
+    else if (tinfo->xdp != NULL)
+        nrecvd = recv_xdp(tinfo, pkts, r->which, depth, recvd, &saved_errno);
+    for (j = 0; j < nready && nrecvd < depth; j++)
+    {
+        slot = (j + r->last_slot) % nready;
+        current_socket = tinfo->poller.ready[slot];
+        want = depth - nrecvd;
+        i = recv_batch(tinfo, current_socket, &pkts[nrecvd],
+                       want, &recvd[nrecvd], &saved_errno);
+        if (i < want)
+        {
+            if (i == 0 && saved_errno != EAGAIN)
+                break;
+            perf_os_poller_idle(&tinfo->poller, current_socket);
+            nidle++;
+        }
+        if (i > 0)
+        {
+            nrecvd += i;
+            r->last_slot = slot + 1;
+        }
+    }
+    r->more = nrecvd > 0 || nready > nidle;
+
+    /* Retire the answered queries and hand their IDs back */
+    for (i = 0; i < nrecvd; i++)
+    {
+        if (recvd[i].short_response)
+            continue;
+
+        q = &tinfo->queries[recvd[i].qid];
+        if (__atomic_load_n(&q->state, __ATOMIC_ACQUIRE) != QUERY_OUTSTANDING ||
+            !perf_net_sockeq(q->sock, recvd[i].sock) || !query_claim(q))
+        {
+            recvd[i].unexpected = true;
+            continue;
+        }
+        wheel_unlink(tinfo->wheel, recvd[i].qid);
+        recvd[i].sent = q->timestamp;
+        recvd[i].intended = q->intended;
+        /* A kernel stamp converted from the wall clock can land
+         * just before the send stamp on a loaded host. */
+        recvd[i].latency = recvd[i].when > recvd[i].sent ? recvd[i].when - recvd[i].sent : 0; // 找到了，这里就是统计延迟的。
+        recvd[i].qtype = q->qtype;
+        recvd[i].desc = q->desc;
+        q->desc = NULL;
+        qid_put(tinfo, q);
+    }
+    qid_publish(tinfo);
 
-    n = perf_net_recv(&tinfo->socks[which_sock], packet_buffer, packet_size, 0);
-    now = get_time();
-    if (n < 0)
+    /*
+     * Publish the counters.  Only plain counter updates go inside the
+     * write section, so a reader never retries across a log write or an
+     * allocation; the rest of the processing follows it.
+     */
+    stats_write_begin(&stats->seq);
+    for (i = 0; i < nrecvd; i++)
     {
-        *saved_errnop = errno;
-        return false;
+        if (recvd[i].short_response || recvd[i].unexpected)
+            continue;
+        latency = recvd[i].latency;
+
+        stats->num_completed++;
+        stats->total_response_size += recvd[i].size;
+        stats->rcodecounts[recvd[i].rcode]++;
+        if (tinfo->sources != NULL)
+        {
+            source = source_of(tinfo, recvd[i].sock);
+            source->num_completed++;
+            source->latency_sum += latency;
+        }
+        if (tinfo->incoming != NULL && recvd[i].cpu >= 0 && recvd[i].cpu < PERF_OS_MAX_CPUS)
+        {
+            incoming = &tinfo->incoming[recvd[i].cpu];
+            if (latency < incoming->latency_min || incoming->num_completed == 0)
+                incoming->latency_min = latency;
+            if (latency > incoming->latency_max)
+                incoming->latency_max = latency;
+            incoming->latency_sum += latency;
+            incoming->num_completed++;
+        }
+        stats->latency_sum += latency;
+        stats->latency_sum_squares += (double)latency * latency;
+        if (latency < stats->latency_min || stats->num_completed == 1)
+            stats->latency_min = latency;
+        if (latency > stats->latency_max)
+            stats->latency_max = latency;
+        if (tinfo->config->kernel_timestamps)
+        {
+            user_latency = recvd[i].when_user - recvd[i].sent;
+            stats->user_latency_sum += user_latency;
+            if (user_latency < stats->user_latency_min || stats->num_completed == 1)
+                stats->user_latency_min = user_latency;
+            if (user_latency > stats->user_latency_max)
+                stats->user_latency_max = user_latency;
+        }
     }
-    recvd->sock = &tinfo->socks[which_sock];
-    recvd->qid = ntohs(packet_header[0]);
-    recvd->rcode = ntohs(packet_header[1]) & 0xF;
-    recvd->size = n;
-    recvd->when = now;
-    recvd->sent = 0;
-    recvd->unexpected = false;
-    recvd->short_response = (n < 4);
-    recvd->desc = NULL;
-    return true;
-}
+    stats_write_end(&stats->seq);
 
-static inline void
-bit_set(unsigned char *bits, unsigned int bit)
-{
-    unsigned int shift, mask;
+    /* Now do the rest of the processing */
+    for (i = 0; i < nrecvd; i++)
+    {
+        if (recvd[i].short_response)
+        {
+            perf_log_warning("received short response");
+            continue;
+        }
+        if (recvd[i].unexpected)
+        {
+            perf_log_warning("received a response with an "
+                             "unexpected (maybe timed out) "
+                             "id: %u",
+                             recvd[i].qid);
+            continue;
+        }
+        latency = recvd[i].latency;
+        perf_hist_record(&tinfo->latency, latency);
+        if (tinfo->config->open_loop)
+            perf_hist_record(&tinfo->corrected,
+                             recvd[i].when > recvd[i].intended ? recvd[i].when - recvd[i].intended : 0);
+        if (tinfo->config->kernel_timestamps)
+            perf_hist_record(&tinfo->user_latency, recvd[i].when_user - recvd[i].sent);
+        if (interval != NULL)
+            perf_hist_record(interval, latency);
+        record_breakdown(tinfo, &recvd[i], latency);
+        if (tinfo->capture != NULL)
+        {
+            rec.sent = recvd[i].sent;
+            rec.latency = latency;
+            rec.socket = recvd[i].sock - tinfo->socks + tinfo->socket_offset;
+            rec.qtype = recvd[i].qtype;
+            rec.size = recvd[i].size;
+            rec.rcode = recvd[i].rcode;
+            perf_capture_add(tinfo->capture, &rec);
+        }
+        if (tinfo->latency_detail != NULL && tinfo->latency_num < g_details)  // 把延迟存起来
+        {
+            //printf("thread address=%u\n", tinfo);
+            tinfo->latency_detail[tinfo->latency_num] = latency;
+            tinfo->latency_num++;
+        }
+        else if (tinfo->latency_detail != NULL)
+        {
+            tinfo->latency_dropped++;
+        }
+        if (recvd[i].desc != NULL)
+        {
+            perf_log_printf(
+                "> %s %s %u.%06u",
+                perf_dns_rcode_strings[recvd[i].rcode],
+                recvd[i].desc,
+                (unsigned int)(latency / BILLION),
+                (unsigned int)(latency % BILLION / 1000));
+            free(recvd[i].desc);
+        }
+    }
 
-    shift = 7 - (bit % 8);
-    mask = 1 << shift;
+    if (nrecvd > 0)
+    {
+        tinfo->last_recv = recvd[nrecvd - 1].when_user;
+        *nowp = tinfo->last_recv;
+    }
+    if (tinfo->config->incoming_steer && stats->num_completed >= tinfo->steer_next)
+        steer_receiver(tinfo);
+    if (interval != NULL)
+        __atomic_store_n(&tinfo->interval_ack, gen, __ATOMIC_RELEASE);
 
-    bits[bit / 8] |= mask;
+    /*
+     * If there was an error, handle it (by either ignoring it,
+     * blocking, or exiting).
+     */
+    if (saved_errno == EINTR)
+    {
+        r->more = true;
+    }
+    else if (saved_errno != 0 && saved_errno != EAGAIN)
+    {
+        perf_log_fatal("failed to receive packet: %s",
+                       strerror(saved_errno));
+    }
+    return nrecvd;
 }
 
-static inline bool
-bit_check(unsigned char *bits, unsigned int bit)
+/*
+ * Pick up sockets that became readable, blocking for up to timeout
+ * microseconds only if the last round left nothing behind.
+ */
+static void
+recv_wait(threadinfo_t *tinfo, receiver_t *r, int64_t timeout, uint64_t *nowp)
 {
-    unsigned int shift;
+    uint64_t now, gap;
 
-    shift = 7 - (bit % 8);
+    /*
+     * A busy-polling receiver never sleeps: it collects the sockets
+     * that became readable without blocking, so that the next round
+     * reads only those, and keeps track of how long its rounds take.
+     */
+    if (tinfo->config->busy_poll)
+    {
+        if (tinfo->uring == NULL && tinfo->xdp == NULL)
+            perf_os_poller_wait(&tinfo->poller, 0);
+        now = perf_os_clock_now();
+        if (r->last_poll != 0 && now > r->last_poll)
+        {
+            gap = now - r->last_poll;
+            tinfo->poll_gaps[63 - __builtin_clzll(gap)]++;
+            if (gap > tinfo->poll_gap_max)
+                tinfo->poll_gap_max = gap;
+        }
+        r->last_poll = *nowp = now;
+        return;
+    }
 
-    if ((bits[bit / 8] >> shift) & 0x01)
-        return true;
-    return false;
+    if (r->more)
+        timeout = 0;
+    if (tinfo->uring != NULL)
+    {
+        if (timeout > 0)
+            perf_net_uring_wait(tinfo->uring, timeout);
+    }
+    else if (tinfo->xdp != NULL)
+    {
+        if (timeout > 0)
+            perf_net_xdp_wait(tinfo->xdp, timeout);
+    }
+    else
+    {
+        perf_os_poller_wait(&tinfo->poller, timeout);
+    }
+    if (timeout > 0)
+        *nowp = perf_os_clock_now();
 }
 
 static void *
 do_recv(void *arg)
 {
     threadinfo_t *tinfo;
-    stats_t *stats;
-    unsigned char packet_buffer[MAX_EDNS_PACKET];
-    received_query_t recvd[RECV_BATCH_SIZE] = {{0, 0, 0, 0, 0, 0, false, false, 0}};
-    unsigned int nrecvd;
-    int saved_errno;
-    unsigned char socketbits[MAX_SOCKETS / 8];
-    uint64_t now, latency;
-    query_info *q;
-    unsigned int current_socket, last_socket;
-    unsigned int i, j;
+    receiver_t receiver;
+    uint64_t now;
 
     tinfo = (threadinfo_t *)arg;
-    stats = &tinfo->stats;
+    receiver_init(tinfo, &receiver);
 
     wait_for_start();
-    now = get_time();
-    last_socket = 0;
+    now = perf_os_clock_now();
     while (!interrupted)
     {
         process_timeouts(tinfo, now);
@@ -1143,165 +3004,154 @@ do_recv(void *arg)
          * If we're done sending and either all responses have been
          * received, stop.
          */
-        if (tinfo->done_sending && num_outstanding(stats) == 0)
+        if (tinfo->done_sending && num_outstanding(tinfo) == 0)
             break;
 
-        /*
-         * Try to receive a few packets, so that we can process them
-         * atomically.
-         */
-        saved_errno = 0;
-        memset(socketbits, 0, sizeof(socketbits));
-        for (i = 0; i < RECV_BATCH_SIZE; i++)
-        {
-            for (j = 0; j < tinfo->nsocks; j++)
-            {
-                current_socket = (j + last_socket) % tinfo->nsocks;
-                if (bit_check(socketbits, current_socket))
-                    continue;
-                if (recv_one(tinfo, current_socket, packet_buffer,
-                             sizeof(packet_buffer), &recvd[i], &saved_errno))
-                {
-                    last_socket = (current_socket + 1);
-                    break;
-                }
-                bit_set(socketbits, current_socket);
-                if (saved_errno != EAGAIN)
-                    break;
-            }
-            if (j == tinfo->nsocks)
-                break;
-        }
-        nrecvd = i;
-
-        /* Do all of the processing that requires the lock */
-        LOCK(&tinfo->lock);
-        for (i = 0; i < nrecvd; i++)
-        {
-            if (recvd[i].short_response)
-                continue;
+        recv_round(tinfo, &receiver, &now);
+        recv_wait(tinfo, &receiver, TIMEOUT_CHECK_TIME, &now);
+    }
 
-            q = &tinfo->queries[recvd[i].qid];
-            if (q->list != &tinfo->outstanding_queries || q->timestamp == ISC_UINT64_MAX || !perf_net_sockeq(q->sock, recvd[i].sock))
-            {
-                recvd[i].unexpected = true;
-                continue;
-            }
-            query_move(tinfo, q, append_unused);
-            recvd[i].sent = q->timestamp;
-            recvd[i].desc = q->desc;
-            q->desc = NULL;
-        }
-        SIGNAL(&tinfo->cond);
-        UNLOCK(&tinfo->lock);
+    __atomic_store_n(&tinfo->recv_exited, true, __ATOMIC_RELEASE);
+    receiver_cleanup(&receiver);
+    return NULL;
+}
 
-        /* Now do the rest of the processing unlocked */
-        for (i = 0; i < nrecvd; i++)
-        {
-            if (recvd[i].short_response)
-            {
-                perf_log_warning("received short response");
-                continue;
-            }
-            if (recvd[i].unexpected)
-            {
-                perf_log_warning("received a response with an "
-                                 "unexpected (maybe timed out) "
-                                 "id: %u",
-                                 recvd[i].qid);
-                continue;
-            }
-            latency = recvd[i].when - recvd[i].sent; // 找到了，这里就是统计延迟的。
-            if (tinfo->latency_num < g_details - 1)  // 把延迟存起来
-            {
-                //printf("thread address=%u\n", tinfo);
-                tinfo->latency_detail[tinfo->latency_num] = latency;
-                tinfo->latency_num++;
-            }
-            if (recvd[i].desc != NULL)
-            {
-                perf_log_printf(
-                    "> %s %s %u.%06u",
-                    perf_dns_rcode_strings[recvd[i].rcode],
-                    recvd[i].desc,
-                    (unsigned int)(latency / MILLION),
-                    (unsigned int)(latency % MILLION));
-                free(recvd[i].desc);
-            }
+/*
+ * Run-to-completion engine: a single thread, pinned to its own CPU,
+ * alternates send and receive rounds on the thread's sockets, and only
+ * sleeps in the poller when neither side can make progress.
+ */
+static void *
+do_rtc(void *arg)
+{
+    threadinfo_t *tinfo;
+    sender_t sender;
+    receiver_t receiver;
+    uint64_t now, until;
+    int64_t timeout;
 
-            stats->num_completed++;
-            stats->total_response_size += recvd[i].size;
-            stats->rcodecounts[recvd[i].rcode]++;
-            stats->latency_sum += latency;
-            stats->latency_sum_squares += (latency * latency);
-            if (latency < stats->latency_min || stats->num_completed == 1)
-                stats->latency_min = latency;
-            if (latency > stats->latency_max)
-                stats->latency_max = latency;
-        }
+    tinfo = (threadinfo_t *)arg;
+    sender_init(tinfo, &sender);
+    receiver_init(tinfo, &receiver);
 
-        if (nrecvd > 0)
-            tinfo->last_recv = recvd[nrecvd - 1].when;
+    wait_for_start();
+    now = perf_os_clock_now();
+    while (!interrupted)
+    {
+        process_timeouts(tinfo, now);
 
-        /*
-         * If there was an error, handle it (by either ignoring it,
-         * blocking, or exiting).
-         */
-        if (nrecvd < RECV_BATCH_SIZE)
+        until = ISC_UINT64_MAX;
+        if (!tinfo->done_sending)
         {
-            if (saved_errno == EINTR)
-            {
-                continue;
-            }
-            else if (saved_errno == EAGAIN)
-            {
-                perf_os_waituntilanyreadable(tinfo->socks, tinfo->nsocks,
-                                             threadpipe[0], TIMEOUT_CHECK_TIME);
-                now = get_time();
-                continue;
-            }
+            if (sender.done || now >= tinfo->times->stop_time)
+                sender_finish(tinfo, &sender);
             else
-            {
-                perf_log_fatal("failed to receive packet: %s",
-                               strerror(saved_errno));
-            }
+                until = send_round(tinfo, &sender, &now, false);
         }
+        if (tinfo->done_sending && num_outstanding(tinfo) == 0)
+            break;
+
+        recv_round(tinfo, &receiver, &now);
+
+        if (until <= now)
+            timeout = 0;
+        else if (until - now > TIMEOUT_CHECK_TIME * 1000)
+            timeout = TIMEOUT_CHECK_TIME;
+        else if (tinfo->arrival != NULL)
+            timeout = until - now > RTC_SPIN_TIME * 1000 ? (until - now) / 1000 - RTC_SPIN_TIME : 0;
+        else
+            timeout = (until - now + 999) / 1000;
+        recv_wait(tinfo, &receiver, timeout, &now);
+        if (timeout == 0 && until > now)
+            now = perf_os_clock_now();
     }
 
+    if (!tinfo->done_sending)
+        sender_finish(tinfo, &sender);
+    __atomic_store_n(&tinfo->recv_exited, true, __ATOMIC_RELEASE);
+    receiver_cleanup(&receiver);
     return NULL;
 }
+/*
+ * Take the latency histograms of the interval that just ended from all
+ * threads, into total.  Every thread is first switched to its other
+ * histogram, then each is waited for to finish the round that may still
+ * be using the old one, unless its receiver is gone.
+ */
+static void
+take_interval(const config_t *config, struct perf_hist *total)
+{
+    threadinfo_t *tinfo;
+    uint32_t gen;
+    unsigned int i;
+
+    perf_hist_reset(total);
+    for (i = 0; i < config->threads; i++)
+        __atomic_add_fetch(&threads[i].interval_gen, 1, __ATOMIC_ACQ_REL);
+    for (i = 0; i < config->threads; i++)
+    {
+        tinfo = &threads[i];
+        gen = __atomic_load_n(&tinfo->interval_gen, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&tinfo->interval_ack, __ATOMIC_ACQUIRE) != gen &&
+               !__atomic_load_n(&tinfo->recv_exited, __ATOMIC_ACQUIRE))
+            usleep(100);
+        perf_hist_merge(total, &tinfo->interval[(gen - 1) & 1]);
+        perf_hist_reset(&tinfo->interval[(gen - 1) & 1]);
+    }
+}
 
 static void *
 do_interval_stats(void *arg)
 {
     threadinfo_t *tinfo;
     stats_t total;
+    struct perf_hist latency;
     uint64_t now;
     uint64_t last_interval_time;
-    uint64_t last_completed;
+    uint64_t last_completed, last_sent, last_timedout;
     uint64_t interval_time;
-    uint64_t num_completed;
-    double qps;
+    uint64_t num_completed, num_timedout, outstanding;
+    double qps, sent_qps;
     struct perf_net_socket sock = {.mode = sock_pipe, .fd = threadpipe[0]};
+    cpu_stats_t *incoming = NULL;
+    uint64_t *last_incoming = NULL;
+    char cpus[1024];
+    size_t len;
+    int cpu;
 
     tinfo = arg;
-    last_interval_time = tinfo->times->start_time;
-    last_completed = 0;
+    last_completed = last_sent = last_timedout = 0;
+    if (perf_hist_init(&latency, INTERVAL_PRECISION(tinfo->config)) < 0)
+        perf_log_fatal("out of memory");
+    if (tinfo->config->incoming_cpu)
+    {
+        incoming = calloc(PERF_OS_MAX_CPUS, sizeof(*incoming));
+        last_incoming = calloc(PERF_OS_MAX_CPUS, sizeof(*last_incoming));
+        if (incoming == NULL || last_incoming == NULL)
+            perf_log_fatal("out of memory");
+    }
 
     wait_for_start(); // 等待信号
+    last_interval_time = tinfo->times->start_time;
     while (perf_os_waituntilreadable(&sock, threadpipe[0],
                                      tinfo->config->stats_interval) == ISC_R_TIMEDOUT)
     {
-        now = get_time();
+        now = perf_os_clock_now();
+        take_interval(tinfo->config, &latency);
         sum_stats(tinfo->config, &total);
         interval_time = now - last_interval_time;
         num_completed = total.num_completed - last_completed;
-        qps = num_completed / (((double)interval_time) / MILLION);
+        num_timedout = total.num_timedout - last_timedout;
+        qps = num_completed / (((double)interval_time) / BILLION);
+        sent_qps = (total.num_sent - last_sent) / (((double)interval_time) / BILLION);
+        outstanding = total.num_completed + total.num_timedout;
+        outstanding = total.num_sent > outstanding ? total.num_sent - outstanding : 0;
 
         // 时间字符串输出
         char cur_time[128] = {0};   // yyyy-mm-dd HH-MM-SS
-        uint32_t milli_sec = (unsigned int)(now % MILLION) / 1000; // milliseconds
-        time_t tt = now / MILLION;
+        uint64_t wall = perf_os_clock_towall(now);
+        uint32_t milli_sec = (unsigned int)(wall % BILLION) / MILLION; // milliseconds
+        time_t tt = wall / BILLION;
         struct tm *ttime = localtime(&tt);
         strftime(cur_time, 128, "%Y-%m-%d %H:%M:%S", ttime);
         sprintf(cur_time, "%s.%03u", cur_time, milli_sec);
@@ -1309,11 +3159,43 @@ do_interval_stats(void *arg)
         // perf_log_printf("Time = %u.%06u: QPS = %.6lf",
         //                 (unsigned int)(now / MILLION),
         //                 (unsigned int)(now % MILLION), qps);
-        perf_log_printf("[Report] %s    QPS %.0lf", cur_time, qps);
+        /* With -O incoming-cpu, the QPS each CPU received. */
+        cpus[0] = 0;
+        if (incoming != NULL)
+        {
+            sum_incoming(tinfo->config, incoming);
+            len = 0;
+            for (cpu = 0; cpu < PERF_OS_MAX_CPUS && len < sizeof(cpus); cpu++)
+            {
+                num_completed = incoming[cpu].num_completed - last_incoming[cpu];
+                last_incoming[cpu] = incoming[cpu].num_completed;
+                if (num_completed == 0)
+                    continue;
+                len += snprintf(cpus + len, sizeof(cpus) - len, "%s%d:%.0lf",
+                                len == 0 ? "    CPU " : " ", cpu,
+                                num_completed / (((double)interval_time) / BILLION));
+            }
+        }
+        perf_log_printf("[Report] %s    QPS %.0lf    sent %.0lf    timeouts %" PRIu64
+                        " (loss %.2lf%%)    outstanding %" PRIu64
+                        "    p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f (ms)%s",
+                        cur_time, qps, sent_qps, num_timedout,
+                        SAFE_DIV(100.0 * num_timedout, num_completed + num_timedout),
+                        outstanding,
+                        (double)perf_hist_percentile(&latency, 50) / MILLION,
+                        (double)perf_hist_percentile(&latency, 90) / MILLION,
+                        (double)perf_hist_percentile(&latency, 99) / MILLION,
+                        (double)perf_hist_percentile(&latency, 99.9) / MILLION,
+                        (double)latency.max / MILLION, cpus);
         last_interval_time = now;
         last_completed = total.num_completed;
+        last_sent = total.num_sent;
+        last_timedout = total.num_timedout;
     }
 
+    perf_hist_destroy(&latency);
+    free(last_incoming);
+    free(incoming);
     return NULL;
 }
 
@@ -1321,18 +3203,16 @@ static void
 cancel_queries(threadinfo_t *tinfo)
 {
     struct query_info *q;
+    unsigned int i;
 
-    while (true)
+    for (i = 0; i < NQIDS; i++)
     {
-        q = ISC_LIST_TAIL(tinfo->outstanding_queries);
-        if (q == NULL)
-            break;
-        query_move(tinfo, q, append_unused);
-
-        if (q->timestamp == ISC_UINT64_MAX)
+        q = &tinfo->queries[i];
+        if (q->state != QUERY_OUTSTANDING)
             continue;
+        q->state = QUERY_FREE;
 
-        tinfo->stats.num_interrupted++;
+        tinfo->recv_stats.num_interrupted++;
         if (q->desc != NULL)
         {
             perf_log_printf("> I %s", q->desc);
@@ -1359,27 +3239,78 @@ per_thread(uint32_t total, uint32_t nthreads, unsigned int offset)
     return value;
 }
 
+/*
+ * Open the k'th client socket of the run.  Clients are dealt out over
+ * the local addresses in turn; with a port range each thread owns the
+ * contiguous slice of count ports from first on.
+ */
+static struct perf_net_socket
+open_client(const config_t *config, unsigned int k, unsigned int first,
+            unsigned int count)
+{
+    const isc_sockaddr_t *local;
+    unsigned int port;
+
+    if (config->nlocal == 1 && config->port_last == 0)
+        return perf_net_opensocket(config->mode, &config->server_addr,
+                                   &config->local_addr, k, config->bufsize);
+
+    local = &config->local_addrs[k % config->nlocal];
+    if (config->port_last != 0)
+        return perf_net_opensocket_range(config->mode, &config->server_addr, local,
+                                         config->port_first + k,
+                                         config->port_first + first,
+                                         config->port_first + first + count - 1,
+                                         config->bufsize, config->nlocal > 1);
+
+    /* Each address counts its ports up from -x. */
+    port = isc_sockaddr_getport(local);
+    if (port != 0)
+    {
+        port += k / config->nlocal;
+        if (port >= 0xFFFF)
+            perf_log_fatal("port %u out of range", port);
+    }
+    return perf_net_opensocket_range(config->mode, &config->server_addr, local,
+                                     port, 0, 0, config->bufsize, true);
+}
+
 static void
 threadinfo_init(threadinfo_t *tinfo, const config_t *config,
                 const times_t *times)
 {
     unsigned int offset, socket_offset, i;
-    uint64_t j = 0;
-
-    memset(tinfo, 0, sizeof(*tinfo));
-    MUTEX_INIT(&tinfo->lock);
-    COND_INIT(&tinfo->cond);
+    const char *reason;
+    int cpu, send_cpu, node;
 
-    ISC_LIST_INIT(tinfo->outstanding_queries);
-    ISC_LIST_INIT(tinfo->unused_queries);
-    for (i = 0; i < NQIDS; i++)
+    /*
+     * With -O cpus the CPUs are known before anything is touched, so
+     * the thread's state can be placed on their NUMA node.  The split
+     * engine takes two CPUs per thread, receiver first.
+     */
+    offset = tinfo - threads;
+    cpu = send_cpu = node = -1;
+    if (config->ncpus > 0)
     {
-        ISC_LINK_INIT(&tinfo->queries[i], link);
-        ISC_LIST_APPEND(tinfo->unused_queries, &tinfo->queries[i], link);
-        tinfo->queries[i].list = &tinfo->unused_queries;
+        if (config->rtc)
+        {
+            cpu = config->cpus[offset % config->ncpus];
+        }
+        else
+        {
+            cpu = config->cpus[2 * offset % config->ncpus];
+            send_cpu = config->cpus[(2 * offset + 1) % config->ncpus];
+        }
+        node = perf_os_cpunode(cpu);
+        perf_os_bindnode(tinfo, sizeof(*tinfo), node);
     }
 
-    offset = tinfo - threads;
+    memset(tinfo, 0, sizeof(*tinfo));
+    tinfo->node = node;
+
+    for (i = 0; i < NQIDS; i++)
+        tinfo->free_ids.ids[i] = i;
+    tinfo->free_ids.tail = tinfo->free_ids.next = NQIDS;
 
     tinfo->dnsctx = perf_dns_createctx(config->updates);
 
@@ -1400,7 +3331,7 @@ threadinfo_init(threadinfo_t *tinfo, const config_t *config,
     if (tinfo->max_outstanding > NQIDS)
         tinfo->max_outstanding = NQIDS;
 
-    if (tinfo->nsocks > MAX_SOCKETS)
+    if (tinfo->nsocks > MAX_SOCKETS && config->port_last == 0 && config->nlocal == 1)
         tinfo->nsocks = MAX_SOCKETS;
 
     tinfo->socks = isc_mem_get(mctx, tinfo->nsocks * sizeof(*tinfo->socks));
@@ -1409,35 +3340,154 @@ threadinfo_init(threadinfo_t *tinfo, const config_t *config,
     socket_offset = 0;
     for (i = 0; i < offset; i++)
         socket_offset += threads[i].nsocks;
+    tinfo->socket_offset = socket_offset;
+    if (config->nlocal > 1)
+    {
+        tinfo->sources = calloc(config->nlocal, sizeof(*tinfo->sources));
+        if (tinfo->sources == NULL)
+            perf_log_fatal("out of memory");
+    }
+    if (config->incoming_cpu)
+    {
+        tinfo->incoming = calloc(PERF_OS_MAX_CPUS, sizeof(*tinfo->incoming));
+        if (tinfo->incoming == NULL)
+            perf_log_fatal("out of memory");
+    }
     for (i = 0; i < tinfo->nsocks; i++)
-        tinfo->socks[i] = perf_net_opensocket(config->mode, &config->server_addr,
-                                              &config->local_addr,
-                                              socket_offset++,
-                                              config->bufsize);
+    {
+        tinfo->socks[i] = open_client(config, socket_offset + i, socket_offset, tinfo->nsocks);
+        if (config->kernel_timestamps && perf_net_rxtimestamps(&tinfo->socks[i]) < 0)
+            perf_log_warning("unable to enable kernel timestamps: %s", strerror(errno));
+        if ((config->net_flags & PERF_NET_GSO) && perf_net_gso(&tinfo->socks[i]) < 0)
+            perf_log_warning("UDP GSO unavailable (%s), sending without it", strerror(errno));
+        if (config->udp_gro && perf_net_gro(&tinfo->socks[i]) < 0)
+            perf_log_warning("UDP GRO unavailable (%s), receiving without it", strerror(errno));
+        if (config->busy_poll_usec > 0 && perf_net_busypoll(&tinfo->socks[i], config->busy_poll_usec) < 0)
+            perf_log_warning("SO_BUSY_POLL unavailable: %s", strerror(errno));
+        if (config->incoming_cpu && perf_net_trackcpu(&tinfo->socks[i], &config->server_addr) < 0)
+            perf_log_warning("unable to track the receiving CPU: %s", strerror(errno));
+    }
     tinfo->current_sock = 0;
 
-    // 延迟明细变量初始化，分配堆大小
-    tinfo->latency_num = 0;
-    tinfo->latency_detail = (uint64_t *)malloc(g_details * sizeof(int64_t));
-    if (tinfo->latency_detail == NULL)
+    tinfo->sent = calloc(NQIDS, sizeof(*tinfo->sent));
+    tinfo->wheel = malloc(sizeof(*tinfo->wheel));
+    if (tinfo->sent == NULL || tinfo->wheel == NULL)
+        perf_log_fatal("out of memory");
+    perf_os_bindnode(tinfo->sent, NQIDS * sizeof(*tinfo->sent), node);
+    perf_os_bindnode(tinfo->wheel, sizeof(*tinfo->wheel), node);
+    wheel_init(tinfo->wheel, perf_os_clock_now());
+
+    if (config->net_flags & PERF_NET_URING)
+    {
+        tinfo->uring = perf_net_uring_create(tinfo->socks, tinfo->nsocks,
+                                             &config->server_addr,
+                                             config->net_flags, &reason);
+        if (tinfo->uring == NULL)
+            perf_log_warning("io_uring unavailable (%s), using sockets", reason);
+    }
+    if (config->net_flags & PERF_NET_XDP)
+    {
+        struct perf_net_xdpconf xdpconf = config->xdp;
+
+        xdpconf.queue += offset;
+        tinfo->xdp = perf_net_xdp_create(tinfo->socks, tinfo->nsocks,
+                                         &config->server_addr,
+                                         &config->local_addr, &xdpconf,
+                                         &reason);
+        if (tinfo->xdp == NULL)
+            perf_log_warning("AF_XDP unavailable (%s), using sockets", reason);
+    }
+    /* The io_uring and AF_XDP engines wait on their rings instead. */
+    if (tinfo->uring == NULL && tinfo->xdp == NULL)
+        perf_os_poller_init(&tinfo->poller, tinfo->socks, tinfo->nsocks, threadpipe[0]);
+
+    if (capture != NULL)
+        tinfo->capture = perf_capture_producer(capture, offset);
+    if (perf_hist_init(&tinfo->latency, config->precision) < 0)
+        perf_log_fatal("out of memory");
+    perf_os_bindnode(tinfo->latency.counts, tinfo->latency.nbuckets * sizeof(*tinfo->latency.counts), node);
+    if (tinfo->max_qps > 0)
+    {
+        tinfo->arrival = malloc(sizeof(*tinfo->arrival));
+        if (tinfo->arrival == NULL || perf_hist_init(&tinfo->send_lag, config->precision) < 0)
+            perf_log_fatal("out of memory");
+        perf_arrival_init(tinfo->arrival, &config->arrival, tinfo->max_qps, offset);
+        perf_os_bindnode(tinfo->arrival, sizeof(*tinfo->arrival), node);
+        perf_os_bindnode(tinfo->send_lag.counts,
+                         tinfo->send_lag.nbuckets * sizeof(*tinfo->send_lag.counts), node);
+    }
+    if (config->open_loop)
     {
-        printf("alloc memory failed, make sure memory is enough\n");
-        exit(1);
+        if (perf_hist_init(&tinfo->corrected, config->precision) < 0)
+            perf_log_fatal("out of memory");
+        perf_os_bindnode(tinfo->corrected.counts,
+                         tinfo->corrected.nbuckets * sizeof(*tinfo->corrected.counts), node);
+    }
+    if (config->kernel_timestamps)
+    {
+        if (perf_hist_init(&tinfo->user_latency, config->precision) < 0)
+            perf_log_fatal("out of memory");
+        perf_os_bindnode(tinfo->user_latency.counts,
+                         tinfo->user_latency.nbuckets * sizeof(*tinfo->user_latency.counts), node);
+    }
+    if (config->stats_interval > 0)
+    {
+        for (i = 0; i < 2; i++)
+        {
+            if (perf_hist_init(&tinfo->interval[i], INTERVAL_PRECISION(config)) < 0)
+                perf_log_fatal("out of memory");
+            perf_os_bindnode(tinfo->interval[i].counts,
+                             tinfo->interval[i].nbuckets * sizeof(*tinfo->interval[i].counts), node);
+        }
     }
 
-    for (j = 0; j < g_details; j++)
-        tinfo->latency_detail[j] = 0;
+    // 延迟明细变量初始化，分配堆大小; only with -C or -w
+    tinfo->latency_num = 0;
+    if (g_details > 0)
+    {
+        tinfo->latency_detail = (uint64_t *)malloc(g_details * sizeof(int64_t));
+        if (tinfo->latency_detail == NULL)
+            perf_log_fatal("out of memory");
+        perf_os_bindnode(tinfo->latency_detail, g_details * sizeof(int64_t), node);
+    }
 
+    /*
+     * Threads are pinned here, before they pass the start barrier, so
+     * none of the measured run is spent on the wrong CPU.
+     */
+    tinfo->cpu = tinfo->send_cpu = -1;
+    if (config->rtc)
+    {
+        THREAD(&tinfo->sender, do_rtc, tinfo);
+        if (config->ncpus > 0)
+            tinfo->cpu = perf_os_pincpu(tinfo->sender, cpu);
+        else
+            tinfo->cpu = perf_os_pinthread(tinfo->sender, offset);
+        return;
+    }
     THREAD(&tinfo->receiver, do_recv, tinfo); // 接收线程
     THREAD(&tinfo->sender, do_send, tinfo);   // 发送线程
+    if (config->ncpus > 0)
+    {
+        tinfo->cpu = perf_os_pincpu(tinfo->receiver, cpu);
+        tinfo->send_cpu = perf_os_pincpu(tinfo->sender, send_cpu);
+    }
+    else if (config->busy_poll)
+    {
+        /* The spinning receiver gets a CPU of its own, the senders
+         * the ones after all receivers'. */
+        tinfo->cpu = perf_os_pinthread(tinfo->receiver, offset);
+        tinfo->send_cpu = perf_os_pinthread(tinfo->sender, config->threads + offset);
+    }
 }
 
 static void
 threadinfo_stop(threadinfo_t *tinfo)
 {
-    SIGNAL(&tinfo->cond);
+    wake_sender(tinfo);
     JOIN(tinfo->sender, NULL);
-    JOIN(tinfo->receiver, NULL);
+    if (!tinfo->config->rtc)
+        JOIN(tinfo->receiver, NULL);
 }
 
 static void
@@ -1447,6 +3497,12 @@ threadinfo_cleanup(threadinfo_t *tinfo, times_t *times)
 
     if (interrupted)
         cancel_queries(tinfo);
+    if (tinfo->uring == NULL && tinfo->xdp == NULL)
+        perf_os_poller_cleanup(&tinfo->poller);
+    if (tinfo->uring != NULL)
+        perf_net_uring_destroy(tinfo->uring);
+    if (tinfo->xdp != NULL)
+        perf_net_xdp_destroy(tinfo->xdp);
     for (i = 0; i < tinfo->nsocks; i++)
         perf_net_close(&tinfo->socks[i]);
     isc_mem_put(mctx, tinfo->socks, tinfo->nsocks * sizeof(*tinfo->socks));
@@ -1456,83 +3512,46 @@ threadinfo_cleanup(threadinfo_t *tinfo, times_t *times)
     // 清理分配的内存
     if (tinfo->latency_detail != NULL)
         free(tinfo->latency_detail);
+    perf_hist_destroy(&tinfo->latency);
+    perf_hist_destroy(&tinfo->corrected);
+    perf_hist_destroy(&tinfo->user_latency);
+    perf_hist_destroy(&tinfo->send_lag);
+    free(tinfo->arrival);
+    perf_hist_destroy(&tinfo->interval[0]);
+    perf_hist_destroy(&tinfo->interval[1]);
+    free_breakdown(&tinfo->breakdown);
+    free(tinfo->sources);
+    free(tinfo->incoming);
+    free(tinfo->wheel);
+    free(tinfo->sent);
 }
 
+/*
+ * Raw samples are only kept with -C.  Latency percentiles come from
+ * the histograms either way.
+ */
 void check_detail_num(config_t *config)
 {
-    if (config->details <= 0)
-    {
-        config->details = 1;
-    }
-    g_details = config->details * NUM_BASE;
-    printf("[Status] INFO: set details per thread = %ld\n", g_details);
-}
-
-void check_memory(const config_t *config)
-{
-    float request_gb = (float)(g_details * sizeof(int64_t)) / 1024 / 1024 / 1024; // 期望的GB，是该分配的threads*2倍：每个threads原始一份，快速排序一份
-    request_gb = config->threads * 2 * request_gb;
-    long page_size = sysconf(_SC_PAGESIZE);     // 页面大小
-    long free_page = sysconf(_SC_AVPHYS_PAGES); // 可用该页面数
-    long phy_page = sysconf(_SC_PHYS_PAGES);    // 总页面数
-    float free_gb = (float)(free_page * page_size) / 1024 / 1024 / 1024;
-    float phy_gb = (float)(phy_page * page_size) / 1024 / 1024 / 1024;
-    char info[1024] = {0};
-
-    sprintf(info, "request %.2f GB, total %.2f GB", request_gb, phy_gb);
-    if (phy_gb < request_gb)
-    {
-        printf("[Status] ERROR: %s, ACTION: exit\n", info);
-        exit(1);
-    }
-    else
-    {
-        printf("[Status] INFO: %s, ACTION: pass\n", info);
-    }
-    
-
-    sprintf(info, "request %.2f GB, free %.2f GB", request_gb, free_gb);
-    if (free_gb < request_gb)
-    {
-        printf("[Status] WARNING: %s, ACTION: continue\n", info);
-    }
-    else
-    {
-        printf("[Status] INFO: %s, ACTION: pass\n", info);
-    }
-    
+    g_details = (uint64_t)config->details * NUM_BASE;
+    if (g_details > 0)
+        printf("[Status] INFO: set details per thread = %" PRIu64 "\n", g_details);
 }
 
-void save_output_file(const config_t *config, threadinfo_t *p_threads)
+/*
+ * Finish the -w capture, once the receivers are done.
+ */
+void close_capture(const config_t *config)
 {
-    if (config->file_name == NULL)
-        return;
+    uint64_t written, dropped;
 
-    FILE *fp = NULL;
-    char *file_name = NULL;
-    uint32_t i;
-    uint64_t pos;
-    threadinfo_t *tinfo = NULL;
-
-    printf("save data to %s\n", config->file_name);
-    fp = fopen(config->file_name, "w+");
-    if (fp == NULL)
-    {
-        printf("create file %s failed, can not save data\n", config->file_name);
+    if (capture == NULL)
         return;
-    }
-
-    for (i = 0; i < config->threads; i++)
-    {
-        tinfo = &p_threads[i];
-        for (pos = 0; pos < tinfo->latency_num; pos++)
-        {
-            fprintf(fp, "%.3f ms\n", (float)tinfo->latency_detail[pos] / 1000);
-        }
-    }
-
-    if (fp != NULL)
-        fclose(fp);
+    written = perf_capture_close(capture, &dropped);
+    capture = NULL;
+    printf("[Status] Captured %" PRIu64 " responses to %s", written, config->file_name);
+    if (dropped > 0)
+        printf(", %" PRIu64 " dropped as the writer fell behind", dropped);
+    printf("\n");
 }
 
 int main(int argc, char **argv)
@@ -1577,8 +3596,9 @@ int main(int argc, char **argv)
 
     // 检查明细数据包数
     check_detail_num(&config);
-    // 检查内存是否够用
-    check_memory(&config);
+
+    if (config.file_name != NULL)
+        capture = perf_capture_open(config.file_name, config.threads, perf_os_clock_now());
 
     // 初始化
     p_threads = threads; // 保存测试线程地址
@@ -1586,6 +3606,32 @@ int main(int argc, char **argv)
     {
         threadinfo_init(&threads[i], &config, &times);
     }
+    if (config.rtc || config.busy_poll || config.ncpus > 0)
+    {
+        /* Split threads show as receiver/sender. */
+        printf("[Status] Thread CPUs:");
+        for (i = 0; i < config.threads; i++)
+        {
+            if (threads[i].cpu >= 0)
+                printf(" %d", threads[i].cpu);
+            else
+                printf(" unpinned");
+            if (config.rtc)
+                continue;
+            if (threads[i].send_cpu >= 0)
+                printf("/%d", threads[i].send_cpu);
+            else
+                printf("/unpinned");
+        }
+        printf("\n");
+        if (config.ncpus > 0 && threads[0].node >= 0)
+        {
+            printf("[Status] Thread NUMA nodes:");
+            for (i = 0; i < config.threads; i++)
+                printf(" %d", threads[i].node);
+            printf("\n");
+        }
+    }
 
     if (config.stats_interval > 0)
     {
@@ -1595,13 +3641,12 @@ int main(int argc, char **argv)
         THREAD(&stats_thread.sender, do_interval_stats, &stats_thread);
     }
 
-    times.start_time = get_time();
+    times.start_time = perf_os_clock_now();
     if (config.timelimit > 0)
         times.stop_time = times.start_time + config.timelimit;
     else
         times.stop_time = ISC_UINT64_MAX;
-    times.stop_time_ns.tv_sec = times.stop_time / MILLION;
-    times.stop_time_ns.tv_nsec = (times.stop_time % MILLION) * 1000;
+    perf_os_clock_totimespec(times.stop_time, &times.stop_time_ns);
 
     LOCK(&start_lock);
     started = true;
@@ -1612,11 +3657,11 @@ int main(int argc, char **argv)
     perf_os_blocksignal(SIGINT, false);
     sock.fd = mainpipe[0];
     result = perf_os_waituntilreadable(&sock, intrpipe[0],
-                                       times.stop_time - times.start_time);
+                                       (times.stop_time - times.start_time) / 1000);
     if (result == ISC_R_CANCELED)
         interrupted = true;
 
-    times.end_time = get_time();
+    times.end_time = perf_os_clock_now();
 
     if (write(threadpipe[1], "", 1))
     { // lgtm [cpp/empty-block]
@@ -1630,7 +3675,12 @@ int main(int argc, char **argv)
 
     sum_stats(&config, &total_stats);
     print_statistics(&config, &times, &total_stats, p_threads);
-    save_output_file(&config, p_threads); // 保存明细
+    print_schedule_statistics(&config, &total_stats);
+    print_breakdown(&config);
+    print_source_statistics(&config);
+    print_incoming_statistics(&config);
+    print_floor(&config);
+    close_capture(&config); // 保存明细
 
     // 线程清理放到result之后
     for (i = 0; i < config.threads; i++)